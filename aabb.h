@@ -0,0 +1,92 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "rtweekend.h"
+
+#include <utility>
+
+// Axis-aligned bounding box, stored as one interval per axis.
+// Used by the acceleration structures to cull whole groups of objects with a single slab test.
+class aabb {
+  public:
+    interval x, y, z;
+
+    aabb() {} // The default AABB is empty, since intervals are empty by default.
+
+    aabb(const interval& ix, const interval& iy, const interval& iz)
+      : x(ix), y(iy), z(iz) { }
+
+    aabb(const point3& a, const point3& b) {
+        // Treat the two points a and b as extrema for the bounding box, so we don't require a
+        // particular minimum/maximum coordinate order.
+        x = interval(fmin(a[0],b[0]), fmax(a[0],b[0]));
+        y = interval(fmin(a[1],b[1]), fmax(a[1],b[1]));
+        z = interval(fmin(a[2],b[2]), fmax(a[2],b[2]));
+    }
+
+    // Smallest box enclosing both boxes.
+    aabb(const aabb& box0, const aabb& box1) {
+        x = interval(box0.x, box1.x);
+        y = interval(box0.y, box1.y);
+        z = interval(box0.z, box1.z);
+    }
+
+    const interval& axis(int n) const {
+        if (n == 1) return y;
+        if (n == 2) return z;
+        return x;
+    }
+
+    // Overlap of this box and `other`. Empty (see is_empty) if they do not overlap.
+    aabb intersect(const aabb& other) const {
+        return aabb(interval(x.min >= other.x.min ? x.min : other.x.min, x.max <= other.x.max ? x.max : other.x.max),
+                    interval(y.min >= other.y.min ? y.min : other.y.min, y.max <= other.y.max ? y.max : other.y.max),
+                    interval(z.min >= other.z.min ? z.min : other.z.min, z.max <= other.z.max ? z.max : other.z.max));
+    }
+
+    bool is_empty() const {
+        return x.min > x.max || y.min > y.max || z.min > z.max;
+    }
+
+    point3 centroid() const {
+        return point3(0.5*(x.min + x.max), 0.5*(y.min + y.max), 0.5*(z.min + z.max));
+    }
+
+    // Surface area drives the SAH cost model: the chance a random ray hits a box is proportional to it.
+    double surface_area() const {
+        if (is_empty()) return 0;
+        auto dx = x.size(), dy = y.size(), dz = z.size();
+        return 2 * (dx*dy + dy*dz + dz*dx);
+    }
+
+    // Index of the axis with the largest extent.
+    int longest_axis() const {
+        if (x.size() > y.size())
+            return x.size() > z.size() ? 0 : 2;
+        return y.size() > z.size() ? 1 : 2;
+    }
+
+    // Slab test: narrow ray_t by the entry/exit distances on each axis, and miss once it is empty.
+    bool hit(const ray& r, interval ray_t) const {
+        for (int a = 0; a < 3; a++) {
+            auto invD = 1 / r.direction()[a];
+            auto orig = r.origin()[a];
+
+            auto t0 = (axis(a).min - orig) * invD;
+            auto t1 = (axis(a).max - orig) * invD;
+
+            if (invD < 0)
+                std::swap(t0, t1);
+
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+};
+
+
+#endif
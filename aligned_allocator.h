@@ -0,0 +1,61 @@
+#ifndef ALIGNED_ALLOCATOR_H
+#define ALIGNED_ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#ifdef _MSC_VER
+    #include <malloc.h>
+#endif
+
+// Size of a cache line on the x86 and ARM machines we render on.
+const std::size_t cache_line_size = 64;
+
+// Minimal standard allocator returning memory aligned to `Alignment` bytes.
+// std::allocator only guarantees alignof(std::max_align_t), which is not enough to keep hot arrays
+// (BVH nodes, framebuffers) from straddling cache lines.
+template <typename T, std::size_t Alignment>
+class aligned_allocator {
+  public:
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind { typedef aligned_allocator<U, Alignment> other; };
+
+    aligned_allocator() {}
+
+    template <typename U>
+    aligned_allocator(const aligned_allocator<U, Alignment>&) {}
+
+    T* allocate(std::size_t n) {
+        void* p = nullptr;
+        auto bytes = n * sizeof(T);
+#ifdef _MSC_VER
+        p = _aligned_malloc(bytes, Alignment);
+#else
+        if (posix_memalign(&p, Alignment, bytes) != 0)
+            p = nullptr;
+#endif
+        if (!p)
+            throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, std::size_t) {
+#ifdef _MSC_VER
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+};
+
+template <typename T, typename U, std::size_t Alignment>
+bool operator==(const aligned_allocator<T, Alignment>&, const aligned_allocator<U, Alignment>&) { return true; }
+
+template <typename T, typename U, std::size_t Alignment>
+bool operator!=(const aligned_allocator<T, Alignment>&, const aligned_allocator<U, Alignment>&) { return false; }
+
+
+#endif
@@ -0,0 +1,374 @@
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+
+#include "rtweekend.h"
+#include "camera.h"
+#include "flat_bvh.h"
+#include "hittable_list.h"
+#include "image_output.h"
+#include "parallel.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Benchmarks selected with --bench NAME. They run instead of rendering and print a report to stdout.
+
+// Traversal work per ray for SAH and SBVH trees over the same scene and the same rays: one ray through
+// the center of every pixel, plus one diffuse bounce from every primary hit, traced single-threaded.
+inline void bench_traversal(const hittable_list& scene, camera& cam, bvh_build_options options) {
+    const bvh_builder builders[] = { bvh_builder::sah, bvh_builder::sbvh };
+    const char* names[] = { "sah", "sbvh" };
+
+    std::vector<shared_ptr<flat_bvh>> trees;
+    std::vector<long long> build_ms;
+    for (auto builder : builders) {
+        options.builder = builder;
+        auto start = std::chrono::high_resolution_clock::now();
+        trees.push_back(make_shared<flat_bvh>(scene, options));
+        build_ms.push_back(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - start).count());
+    }
+
+    cam.initialize();
+    std::vector<ray> rays;
+    for (int j = 0; j < cam.height(); j++) {
+        for (int i = 0; i < cam.image_width; i++) {
+            auto r = cam.center_ray(i, j);
+            rays.push_back(r);
+            hit_record rec;
+            if (trees[0]->hit(r, interval(0.001, infinity), rec))
+                rays.push_back(ray(rec.p, rec.normal + random_unit_vector()));
+        }
+    }
+
+    std::cout << "Traversal benchmark: " << scene.objects.size() << " objects, " << rays.size()
+              << " rays (primary and one diffuse bounce)\n"
+              << "builder  build ms     nodes  references  SAH cost  nodes/ray  prims/ray  Mrays/s\n"
+              << std::fixed;
+    for (size_t t = 0; t < trees.size(); t++) {
+        traversal_stats stats;
+        for (const auto& r : rays) {
+            hit_record rec;
+            trees[t]->hit(r, interval(0.001, infinity), rec, stats);
+        }
+
+        // Time the plain hit(), which does no counting.
+        auto start = std::chrono::high_resolution_clock::now();
+        for (const auto& r : rays) {
+            hit_record rec;
+            trees[t]->hit(r, interval(0.001, infinity), rec);
+        }
+        std::chrono::duration<double> seconds = std::chrono::high_resolution_clock::now() - start;
+
+        std::cout << std::left << std::setw(7) << names[t] << std::right
+                  << std::setw(10) << build_ms[t]
+                  << std::setw(10) << trees[t]->node_count()
+                  << std::setw(12) << trees[t]->leaf_order().size()
+                  << std::setw(10) << std::setprecision(3) << trees[t]->sah_cost()
+                  << std::setw(11) << std::setprecision(2) << static_cast<double>(stats.nodes) / stats.rays
+                  << std::setw(11) << static_cast<double>(stats.primitives) / stats.rays
+                  << std::setw(9) << rays.size() / seconds.count() / 1e6 << "\n";
+    }
+}
+
+// The diffuse-bounce sampler as it was before rng: every coordinate from the process-wide rand(),
+// which glibc guards with a lock.
+inline vec3 rand_unit_vector() {
+    while (true) {
+        auto x = rand() / (RAND_MAX + 1.0);
+        auto y = rand() / (RAND_MAX + 1.0);
+        auto z = rand() / (RAND_MAX + 1.0);
+        auto p = 2 * vec3(x, y, z) - vec3(1, 1, 1);
+        if (p.length_squared() < 1)
+            return unit_vector(p);
+    }
+}
+
+// Throughput of random unit vectors, the sample every diffuse bounce draws, on 1, 2, 4... up to
+// `max_threads` threads at once: from rand() as before, and from per-thread rng generators. Every
+// thread draws the same count, so perfect scaling multiplies the total rate by the thread count.
+inline void bench_rng(int max_threads) {
+    const size_t per_thread = 2000000;
+
+    // Returns millions of samples per second over n threads.
+    auto rate = [&](int n, bool use_rand) {
+        std::vector<double> sums(n); // Keeps the samples from being optimized out.
+        auto start = std::chrono::high_resolution_clock::now();
+        parallel_chunks(static_cast<size_t>(n), n, [&](int c, size_t, size_t) {
+            rng gen(static_cast<uint64_t>(c) + 1);
+            vec3 sum;
+            for (size_t i = 0; i < per_thread; i++)
+                sum += use_rand ? rand_unit_vector() : random_unit_vector(gen);
+            sums[c] = sum.length();
+        });
+        std::chrono::duration<double> seconds = std::chrono::high_resolution_clock::now() - start;
+        return n * per_thread / seconds.count() / 1e6;
+    };
+
+    std::vector<int> counts;
+    for (int n = 1; n < max_threads; n *= 2)
+        counts.push_back(n);
+    counts.push_back(max_threads);
+
+    std::cout << "RNG benchmark: random unit vectors, " << per_thread << " per thread\n"
+              << "threads  rand() M/s  scaling  rng M/s  scaling\n"
+              << std::fixed << std::setprecision(2);
+    double rand_base = 0, rng_base = 0;
+    for (auto n : counts) {
+        auto rand_rate = rate(n, true);
+        auto rng_rate = rate(n, false);
+        if (n == 1) {
+            rand_base = rand_rate;
+            rng_base = rng_rate;
+        }
+        std::cout << std::setw(7) << n << std::setw(12) << rand_rate << std::setw(9) << rand_rate / rand_base
+                  << std::setw(9) << rng_rate << std::setw(9) << rng_rate / rng_base << "\n";
+    }
+}
+
+// The sampling loops vec3.h used before its closed-form warps: draw points in the enclosing square or
+// cube until one falls inside. The generator is a template parameter, so draws can be counted.
+template <typename G>
+vec3 rejection_in_unit_disk(G& gen) {
+    while (true) {
+        auto p = vec3(2*gen.next_double() - 1, 2*gen.next_double() - 1, 0);
+        if (p.length_squared() < 1)
+            return p;
+    }
+}
+
+template <typename G>
+vec3 rejection_in_unit_sphere(G& gen) {
+    while (true) {
+        auto x = 2*gen.next_double() - 1;
+        auto y = 2*gen.next_double() - 1;
+        auto z = 2*gen.next_double() - 1;
+        auto p = vec3(x, y, z);
+        if (p.length_squared() < 1)
+            return p;
+    }
+}
+
+// Counts the numbers drawn from it.
+struct counting_rng {
+    rng gen;
+    uint64_t draws = 0;
+
+    double next_double() {
+        draws++;
+        return gen.next_double();
+    }
+};
+
+// Time per sample and random numbers drawn per sample of the old rejection loops and the closed-form
+// warps, for every shape the renderer samples. Lambertian bounces compare normal + unit vector, as the
+// material used to scatter, with the cosine-weighted hemisphere warp.
+inline void bench_warps() {
+    const size_t count = 10000000;
+    const vec3 normal = unit_vector(vec3(0.3, 0.8, -0.5));
+
+    // Returns nanoseconds per sample, and the draws per sample in `draws`.
+    auto measure = [&](vec3 (*sample)(counting_rng&, const vec3&), double& draws) {
+        counting_rng gen;
+        vec3 sum;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < count; i++)
+            sum += sample(gen, normal);
+        std::chrono::duration<double> seconds = std::chrono::high_resolution_clock::now() - start;
+        draws = static_cast<double>(gen.draws) / count;
+        return sum.length() < 0 ? 0 : seconds.count() / count * 1e9; // Uses sum, so it is computed.
+    };
+
+    struct warp_case {
+        const char* name;
+        vec3 (*rejection)(counting_rng&, const vec3&);
+        vec3 (*closed_form)(counting_rng&, const vec3&);
+    };
+    const warp_case cases[] = {
+        { "disk",
+          [](counting_rng& g, const vec3&) { return rejection_in_unit_disk(g); },
+          [](counting_rng& g, const vec3&) { auto u = g.next_double(); return square_to_unit_disk(u, g.next_double()); } },
+        { "ball",
+          [](counting_rng& g, const vec3&) { return rejection_in_unit_sphere(g); },
+          [](counting_rng& g, const vec3&) {
+              auto u = g.next_double();
+              auto v = g.next_double();
+              return std::cbrt(g.next_double()) * square_to_unit_vector(u, v); } },
+        { "unit vector",
+          [](counting_rng& g, const vec3&) { return unit_vector(rejection_in_unit_sphere(g)); },
+          [](counting_rng& g, const vec3&) { auto u = g.next_double(); return square_to_unit_vector(u, g.next_double()); } },
+        { "lambertian",
+          [](counting_rng& g, const vec3& n) { return n + unit_vector(rejection_in_unit_sphere(g)); },
+          [](counting_rng& g, const vec3& n) {
+              auto u = g.next_double();
+              return local_to_world(square_to_cosine_hemisphere(u, g.next_double()), n); } },
+    };
+
+    std::cout << "Warp benchmark: " << count << " samples per shape\n"
+              << "shape        rejection ns  draws  closed-form ns  draws\n"
+              << std::fixed << std::setprecision(2);
+    for (const auto& c : cases) {
+        double rejection_draws, closed_draws;
+        auto rejection_ns = measure(c.rejection, rejection_draws);
+        auto closed_ns = measure(c.closed_form, closed_draws);
+        std::cout << std::left << std::setw(12) << c.name << std::right
+                  << std::setw(13) << rejection_ns << std::setw(7) << rejection_draws
+                  << std::setw(16) << closed_ns << std::setw(7) << closed_draws << "\n";
+    }
+}
+
+
+// Renders the scene with each tile size and order, with and without splitting slow tiles, and reports
+// the tail: how long the last thread still ran after the first one found no work left. The image is
+// the same every time; only the time it takes and how evenly the threads finish change.
+inline void bench_tiles(const hittable& world, camera cam) {
+    const int sizes[] = { 8, 16, 32 };
+    const tile_order orders[] = { tile_order::rows, tile_order::hilbert, tile_order::spiral };
+    const char* order_names[] = { "rows", "hilbert", "spiral" };
+    const double split_factor = cam.tile_split > 0 ? cam.tile_split : 4;
+
+    if (!cam.initialize())
+        return;
+    std::cout << "Tile benchmark: " << cam.image_width << "x" << cam.height() << " pixels, "
+              << cam.samples_per_pixel << " samples per pixel\n"
+              << "order    size  split  tiles  splits  render ms  tail ms  max idle ms\n"
+              << std::fixed << std::setprecision(1);
+    for (int o = 0; o < 3; o++) {
+        for (auto size : sizes) {
+            for (int split = 0; split < 2; split++) {
+                cam.tile_ordering = orders[o];
+                cam.tile_size = size;
+                cam.tile_split = split ? split_factor : 0;
+
+                framebuffer image;
+                auto start = std::chrono::steady_clock::now();
+                auto stats = cam.render_tiles(world, image, false).scheduler;
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+                uint64_t tiles = 0, splits = 0;
+                double max_idle = 0;
+                auto first_done = stats[0].finished, last_done = stats[0].finished;
+                for (const auto& s : stats) {
+                    tiles += s.tiles;
+                    splits += s.splits;
+                    max_idle = std::max(max_idle, s.idle_seconds);
+                    first_done = std::min(first_done, s.finished);
+                    last_done = std::max(last_done, s.finished);
+                }
+                std::chrono::duration<double, std::milli> tail = last_done - first_done;
+
+                std::cout << std::left << std::setw(8) << order_names[o] << std::right
+                          << std::setw(5) << size
+                          << std::setw(7) << (split ? "on" : "off")
+                          << std::setw(7) << tiles
+                          << std::setw(8) << splits
+                          << std::setw(11) << elapsed.count()
+                          << std::setw(9) << tail.count()
+                          << std::setw(13) << 1000 * max_idle << "\n";
+            }
+        }
+    }
+}
+
+
+// Encodes a synthetic width x height framebuffer as P3 text three ways: through an ostringstream per
+// pixel into fixed text cells, as render() used to; through ostream << per channel; and with the byte
+// buffer encoder of image_output.h. All three must produce the same text.
+inline void bench_encode(int width, int height) {
+    framebuffer image(width, height);
+    image.fill_rows(0, height, rgba{0, 0, 0, 1});
+    rng& gen = thread_rng();
+    for (int j = 0; j < height; j++)
+        for (int i = 0; i < width; i++)
+            image(i, j) = rgba{static_cast<float>(random_double(gen, 0, 1.2)), static_cast<float>(random_double(gen, 0, 1.2)),
+                               static_cast<float>(random_double(gen, 0, 1.2)), 1};
+
+    auto per_pixel_stream = [&]() {
+        std::vector<std::array<char, 32>> cells(image.size());
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                const auto& p = image(i, j);
+                std::ostringstream oss;
+                write_color(oss, color(p.r, p.g, p.b), 1);
+                std::string pixel = oss.str();
+                auto& cell = cells[static_cast<size_t>(j) * width + i];
+                std::fill(cell.begin(), cell.end(), '\0');
+                std::copy(pixel.begin(), pixel.end(), cell.begin());
+            }
+        }
+        std::ostringstream out;
+        out << "P3\n" << width << ' ' << height << "\n255\n";
+        for (const auto& cell : cells)
+            out.write(&cell[0], std::strlen(&cell[0]));
+        return out.str();
+    };
+    auto per_channel_stream = [&]() {
+        std::ostringstream out;
+        out << "P3\n" << width << ' ' << height << "\n255\n";
+        for (int j = 0; j < height; j++)
+            for (int i = 0; i < width; i++)
+                out << quantize(image(i, j).r) << ' ' << quantize(image(i, j).g) << ' ' << quantize(image(i, j).b) << '\n';
+        return out.str();
+    };
+    auto byte_buffer = [&]() {
+        std::ostringstream out;
+        write_ppm(out, image);
+        return out.str();
+    };
+
+    const char* names[] = { "ostringstream per pixel", "ostream << per channel", "byte buffer" };
+    std::function<std::string()> encoders[] = { per_pixel_stream, per_channel_stream, byte_buffer };
+    const int repeats = 3;
+    std::string reference;
+    std::cout << "Encode benchmark: P3 text of " << width << "x" << height << " pixels\n"
+              << "encoder                   Mpixels/s  same output\n" << std::fixed << std::setprecision(2);
+    for (int e = 0; e < 3; e++) {
+        std::string text;
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++)
+            text = encoders[e]();
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        if (e == 0)
+            reference = text;
+        std::cout << std::left << std::setw(26) << names[e] << std::right
+                  << std::setw(9) << repeats * static_cast<double>(image.size()) / seconds.count() / 1e6
+                  << std::setw(13) << (text == reference ? "yes" : "NO") << "\n";
+    }
+
+    // The compressed formats, on this thread and then on a pool of every hardware thread.
+    thread_pool pool;
+    std::cout << "\nformat  threads  Mpixels/s        bytes  same output\n";
+    for (auto format : { image_format::png, image_format::exr }) {
+        std::string serial;
+        for (auto workers : { static_cast<thread_pool*>(nullptr), &pool }) {
+            std::string file;
+            auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < repeats; r++) {
+                std::ostringstream out;
+                write_image(out, image, format, workers);
+                file = out.str();
+            }
+            std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+            if (!workers)
+                serial = file;
+            std::cout << std::left << std::setw(8) << (format == image_format::png ? "png" : "exr") << std::right
+                      << std::setw(7) << block_workers(workers)
+                      << std::setw(11) << repeats * static_cast<double>(image.size()) / seconds.count() / 1e6
+                      << std::setw(13) << file.size()
+                      << std::setw(13) << (file == serial ? "yes" : "NO") << "\n";
+        }
+    }
+}
+
+
+#endif
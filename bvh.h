@@ -0,0 +1,221 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Tuning constants for the surface area heuristic (SAH).
+// The SAH estimates the cost of a split as:
+//   traversal + intersection * (area(left)*count(left) + area(right)*count(right)) / area(parent)
+// since the chance that a ray passing through the parent also passes through a child is proportional to area.
+const int    bvh_sah_bins          = 16;  // Candidate split planes are the boundaries between this many centroid bins.
+const double bvh_traversal_cost    = 1.0; // Relative cost of visiting one interior node...
+const double bvh_intersection_cost = 1.0; // ...and of testing one primitive.
+const int    bvh_max_leaf_size     = 4;   // Ranges this small become leaves when no split beats testing them all.
+
+// Build-time reference to one primitive: its bounds, their centroid and its position in the source list.
+// Builders shuffle these small records around instead of the objects themselves.
+struct bvh_primitive {
+    aabb     bbox;
+    point3   centroid;
+    uint32_t index;
+};
+
+// Binned SAH evaluation for one node.
+// Rather than sorting primitives and trying every possible split, primitive centroids are dropped into
+// fixed-size bins along each axis, and only the planes between bins are evaluated. That makes each
+// level of the build linear in the number of primitives, at a negligible loss in tree quality.
+class sah_binning {
+  public:
+    sah_binning(const aabb& _centroid_bounds) : centroid_bounds(_centroid_bounds) {
+        for (int a = 0; a < 3; a++) {
+            auto extent = centroid_bounds.axis(a).size();
+            scale[a] = extent > 0 ? bvh_sah_bins / extent : 0; // Zero extent means this axis cannot be split.
+            for (int b = 0; b < bvh_sah_bins; b++)
+                counts[a][b] = 0;
+        }
+    }
+
+    int bin_index(int axis, const point3& centroid) const {
+        auto b = static_cast<int>((centroid[axis] - centroid_bounds.axis(axis).min) * scale[axis]);
+        return b < 0 ? 0 : (b >= bvh_sah_bins ? bvh_sah_bins - 1 : b);
+    }
+
+    void add(const aabb& box, const point3& centroid) {
+        for (int a = 0; a < 3; a++) {
+            auto b = bin_index(a, centroid);
+            bounds[a][b] = aabb(bounds[a][b], box);
+            counts[a][b]++;
+        }
+    }
+
+    // Adds the bins of another binning over the same centroid bounds, e.g. one filled by another thread.
+    void merge(const sah_binning& other) {
+        for (int a = 0; a < 3; a++) {
+            for (int b = 0; b < bvh_sah_bins; b++) {
+                bounds[a][b] = aabb(bounds[a][b], other.bounds[a][b]);
+                counts[a][b] += other.counts[a][b];
+            }
+        }
+    }
+
+    // Finds the cheapest split plane over all axes, for a node with the given bounds.
+    // Returns its SAH cost and sets `axis` and `split_bin`: primitives in bins below split_bin go left.
+    // Returns infinity with axis = -1 when no axis can be split (all centroids coincide).
+    double best_split(const aabb& node_bounds, int& axis, int& split_bin) const {
+        auto best_cost = infinity;
+        axis = -1;
+        split_bin = 0;
+
+        auto node_area = node_bounds.surface_area();
+        if (node_area <= 0) node_area = 1;
+
+        for (int a = 0; a < 3; a++) {
+            if (scale[a] == 0)
+                continue;
+
+            // Sweep from the right to record the cost of each right-hand side...
+            double right_cost[bvh_sah_bins];
+            int right_count[bvh_sah_bins];
+            aabb right_box;
+            int count = 0;
+            for (int b = bvh_sah_bins - 1; b > 0; b--) {
+                right_box = aabb(right_box, bounds[a][b]);
+                count += counts[a][b];
+                right_count[b] = count;
+                right_cost[b] = right_box.surface_area() * count;
+            }
+
+            // ...then sweep from the left and combine.
+            aabb left_box;
+            count = 0;
+            for (int b = 1; b < bvh_sah_bins; b++) {
+                left_box = aabb(left_box, bounds[a][b-1]);
+                count += counts[a][b-1];
+                if (count == 0 || right_count[b] == 0)
+                    continue;
+
+                auto cost = bvh_traversal_cost
+                          + bvh_intersection_cost * (left_box.surface_area() * count + right_cost[b]) / node_area;
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    axis = a;
+                    split_bin = b;
+                }
+            }
+        }
+
+        return best_cost;
+    }
+
+    // Bounds of the two sides of a split returned by best_split.
+    void split_bounds(int axis, int split_bin, aabb& left, aabb& right) const {
+        left = aabb();
+        right = aabb();
+        for (int b = 0; b < bvh_sah_bins; b++) {
+            if (b < split_bin)
+                left = aabb(left, bounds[axis][b]);
+            else
+                right = aabb(right, bounds[axis][b]);
+        }
+    }
+
+  private:
+    aabb   centroid_bounds;
+    double scale[3];
+    aabb   bounds[3][bvh_sah_bins];
+    int    counts[3][bvh_sah_bins];
+};
+
+
+// Binary bounding volume hierarchy over a list of hittables.
+// Each node holds the bounds of everything below it, so a ray that misses a node skips its whole subtree,
+// which turns the linear scan of hittable_list::hit into a roughly logarithmic search.
+class bvh_node : public hittable {
+  public:
+    bvh_node(const hittable_list& list) {
+        // The build reorders objects, so work on a copy of the list.
+        auto objects = list.objects;
+        build(objects, 0, objects.size());
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (!bbox.hit(r, ray_t))
+            return false;
+
+        bool hit_left = left->hit(r, ray_t, rec);
+        bool hit_right = right && right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+
+        return hit_left || hit_right;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+  private:
+    shared_ptr<hittable> left;
+    shared_ptr<hittable> right; // Null in leaves, where `left` holds the object (or a small hittable_list).
+    aabb bbox;
+
+    bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end) {
+        build(objects, start, end);
+    }
+
+    void build(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end) {
+        auto object_span = end - start;
+
+        aabb centroid_bounds;
+        for (size_t i = start; i < end; i++) {
+            auto box = objects[i]->bounding_box();
+            auto c = box.centroid();
+            bbox = aabb(bbox, box);
+            centroid_bounds = aabb(centroid_bounds, aabb(c, c));
+        }
+
+        if (object_span == 1) {
+            left = objects[start];
+            return;
+        }
+
+        sah_binning binning(centroid_bounds);
+        for (size_t i = start; i < end; i++) {
+            auto box = objects[i]->bounding_box();
+            binning.add(box, box.centroid());
+        }
+
+        int axis, split_bin;
+        auto split_cost = binning.best_split(bbox, axis, split_bin);
+        auto leaf_cost = bvh_intersection_cost * object_span;
+
+        if (split_cost >= leaf_cost && object_span <= static_cast<size_t>(bvh_max_leaf_size)) {
+            auto leaf = make_shared<hittable_list>();
+            for (size_t i = start; i < end; i++)
+                leaf->add(objects[i]);
+            left = leaf;
+            return;
+        }
+
+        size_t mid;
+        if (axis < 0) {
+            // Every centroid is in the same place, so no plane separates them. Split by count instead.
+            mid = start + object_span/2;
+        } else {
+            auto first = objects.begin() + start;
+            auto middle = std::partition(first, objects.begin() + end,
+                [&](const shared_ptr<hittable>& object) {
+                    return binning.bin_index(axis, object->bounding_box().centroid()) < split_bin;
+                });
+            mid = start + (middle - first);
+        }
+
+        left  = shared_ptr<hittable>(new bvh_node(objects, start, mid));
+        right = shared_ptr<hittable>(new bvh_node(objects, mid, end));
+    }
+};
+
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "rtweekend.h"
+#include "flat_bvh.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+    #include <direct.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// On-disk cache of flat_bvh trees.
+// A build only depends on the primitives' bounding boxes and the build options, so those are hashed into
+// a key, and the finished tree is written to `<directory>/bvh-<key>.bin`. A later run over the same scene
+// maps that file and copies the nodes out instead of building; any change to the scene changes the key,
+// so stale trees are never picked up. Files are written in the machine's native byte order.
+
+// Bump whenever the file layout or flat_bvh_node changes; older files are then rebuilt.
+const uint32_t bvh_cache_version = 2;
+const char bvh_cache_magic[8] = { 'R', 'T', 'B', 'V', 'H', 'C', 'A', 'C' };
+
+// File header, padded to 64 bytes so the nodes after it stay aligned in the mapping.
+// The nodes follow the header, then one uint32 source index per leaf reference, in leaf order.
+struct bvh_cache_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t node_size;       // sizeof(flat_bvh_node), to reject files from differently built programs.
+    uint64_t scene_key;
+    uint64_t node_count;
+    uint64_t primitive_count;
+    uint64_t reference_count; // Leaf references: more than primitive_count when SBVH splits duplicated some.
+    uint8_t  reserved[16];
+};
+
+static_assert(sizeof(bvh_cache_header) == 64, "bvh_cache_header must stay 64 bytes");
+
+// 64-bit FNV-1a over raw bytes.
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+    auto bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Key for the tree built over `list` with `options`. The thread count is left out: it does not change
+// the tree. The leaf batch width is in: it follows the CPU's SIMD support, which changes leaf sizes.
+inline uint64_t bvh_cache_key(const hittable_list& list, const bvh_build_options& options) {
+    int32_t settings[4] = { static_cast<int32_t>(options.builder), options.morton_bits,
+                            static_cast<int32_t>(list.objects.size()),
+                            static_cast<int32_t>(flat_bvh::leaf_batch_for(list.objects)) };
+    auto hash = fnv1a(settings, sizeof(settings));
+    for (const auto& object : list.objects) {
+        auto box = object->bounding_box();
+        double extents[6] = { box.x.min, box.y.min, box.z.min, box.x.max, box.y.max, box.z.max };
+        hash = fnv1a(extents, sizeof(extents), hash);
+    }
+    return hash;
+}
+
+inline std::string bvh_cache_path(const std::string& directory, uint64_t key) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "bvh-%016llx.bin", static_cast<unsigned long long>(key));
+    return directory + "/" + name;
+}
+
+
+// Read-only view of a whole file: memory-mapped where the platform supports it, read into memory otherwise.
+class mapped_file {
+  public:
+    explicit mapped_file(const std::string& path) {
+#if defined(_WIN32)
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            return;
+        buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        bytes = buffer.data();
+        length = buffer.size();
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* mapping = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                bytes = static_cast<const char*>(mapping);
+                length = static_cast<size_t>(info.st_size);
+            }
+        }
+        close(fd); // The mapping stays valid without the descriptor.
+#endif
+    }
+
+    ~mapped_file() {
+#if !defined(_WIN32)
+        if (bytes)
+            munmap(const_cast<char*>(bytes), length);
+#endif
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+  private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+#if defined(_WIN32)
+    std::vector<char> buffer;
+#endif
+};
+
+
+// Loads the cached tree for `list` from `path`. Returns null if the file is missing, was written for a
+// different scene or program version, or fails the consistency checks; a bad file never gets traversed.
+inline shared_ptr<flat_bvh> load_bvh_cache(const std::string& path, const hittable_list& list,
+                                           const bvh_build_options& options, uint64_t key) {
+    mapped_file file(path);
+    if (file.size() < sizeof(bvh_cache_header))
+        return nullptr;
+
+    bvh_cache_header header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    auto primitive_count = list.objects.size();
+    if (std::memcmp(header.magic, bvh_cache_magic, sizeof(header.magic)) != 0
+        || header.version != bvh_cache_version || header.node_size != sizeof(flat_bvh_node)
+        || header.scene_key != key || header.primitive_count != primitive_count
+        || header.reference_count < primitive_count || header.reference_count > 2 * primitive_count
+        || header.node_count > 2 * header.reference_count || (primitive_count > 0 && header.node_count == 0)
+        || file.size() != sizeof(header) + header.node_count * sizeof(flat_bvh_node)
+                          + header.reference_count * sizeof(uint32_t))
+        return nullptr;
+
+    auto node_data = reinterpret_cast<const flat_bvh_node*>(file.data() + sizeof(header));
+    auto order = reinterpret_cast<const uint32_t*>(node_data + header.node_count);
+
+    // Children must come after their parent and leaves must stay within the primitives, or traversal
+    // could loop or read out of bounds. Traversal pushes one stack entry per interior node on the way
+    // down, so no interior node may have flat_bvh_max_depth or more interior ancestors. Children come
+    // after their parents, so one forward sweep finds every node's depth.
+    std::vector<int> depth(static_cast<size_t>(header.node_count), 0);
+    for (uint64_t i = 0; i < header.node_count; i++) {
+        const auto& node = node_data[i];
+        if (node.is_leaf()) {
+            if (static_cast<uint64_t>(node.offset) + node.count > header.reference_count)
+                return nullptr;
+            continue;
+        }
+        if (node.offset <= i + 1 || node.offset >= header.node_count || node.axis > 2
+            || depth[i] >= flat_bvh_max_depth)
+            return nullptr;
+        depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+        depth[node.offset] = std::max(depth[node.offset], depth[i] + 1);
+    }
+
+    // Every reference must name a primitive, and every primitive must be referenced, or it would vanish.
+    std::vector<bool> referenced(primitive_count, false);
+    for (uint64_t i = 0; i < header.reference_count; i++) {
+        if (order[i] >= primitive_count)
+            return nullptr;
+        referenced[order[i]] = true;
+    }
+    if (std::find(referenced.begin(), referenced.end(), false) != referenced.end())
+        return nullptr;
+
+    return make_shared<flat_bvh>(list, node_data, static_cast<size_t>(header.node_count), order,
+                                 static_cast<size_t>(header.reference_count), options);
+}
+
+// Writes `tree`, built over `primitive_count` primitives, to `path`. The file is written under a temporary name and renamed into place, so other
+// runs never see half-written files. Returns false if the file could not be written.
+inline bool save_bvh_cache(const std::string& path, const flat_bvh& tree, size_t primitive_count, uint64_t key) {
+    bvh_cache_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, bvh_cache_magic, sizeof(header.magic));
+    header.version = bvh_cache_version;
+    header.node_size = sizeof(flat_bvh_node);
+    header.scene_key = key;
+    header.node_count = tree.node_count();
+    header.primitive_count = primitive_count;
+    header.reference_count = tree.leaf_order().size();
+
+    auto temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        if (tree.node_count() > 0)
+            out.write(reinterpret_cast<const char*>(&tree.node(0)), tree.node_count() * sizeof(flat_bvh_node));
+        out.write(reinterpret_cast<const char*>(tree.leaf_order().data()),
+                  tree.leaf_order().size() * sizeof(uint32_t));
+        if (!out)
+            return false;
+    }
+    std::remove(path.c_str()); // rename() does not replace existing files on Windows.
+    return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+// Returns the tree for `list`, from the cache in `directory` when it has one, or freshly built (and then
+// stored there). `cache_hit` reports which happened.
+inline shared_ptr<flat_bvh> cached_flat_bvh(const hittable_list& list, const bvh_build_options& options,
+                                            const std::string& directory, bool& cache_hit) {
+    auto key = bvh_cache_key(list, options);
+    auto path = bvh_cache_path(directory, key);
+
+    auto tree = load_bvh_cache(path, list, options, key);
+    cache_hit = tree != nullptr;
+    if (!tree) {
+        tree = make_shared<flat_bvh>(list, options);
+#if defined(_WIN32)
+        _mkdir(directory.c_str());
+#else
+        mkdir(directory.c_str(), 0755); // Fails harmlessly if it already exists.
+#endif
+        if (!save_bvh_cache(path, *tree, list.objects.size(), key))
+            std::clog << "Could not write BVH cache file " << path << "\n";
+    }
+    return tree;
+}
+
+
+#endif
@@ -3,19 +3,78 @@
 
 #include "rtweekend.h"
 #include "color.h"
+#include "framebuffer.h"
 #include "hittable.h"
+#include "image_output.h"
 #include "material.h"
+#include "sampler.h"
+#include "parallel.h"
+#include "scheduler.h"
+#include "thread_pool.h"
 
 
-#include <array>
+#include <algorithm>
+#include <cstdio>
 #include <vector>
 #include <thread>
 #include <mutex>
 #include <atomic>
 #include <chrono>
 #include <iostream>
-#include <sstream>
-#include <queue>
+#include <limits>
+#include <string>
+#include <utility>
+
+// How long the paths of a render were.
+struct path_stats {
+    uint64_t paths = 0;     // Camera samples traced.
+    uint64_t rays = 0;      // Rays traced along them, camera rays included.
+    uint64_t roulette = 0;  // Paths ended by Russian roulette rather than escaping, absorption or max_depth.
+
+    void add(const path_stats& other) {
+        paths += other.paths;
+        rays += other.rays;
+        roulette += other.roulette;
+    }
+};
+
+// Running sums of one pixel's samples: its color, and how noisy that color still is.
+struct pixel_estimate {
+    color    sum;
+    double   luminance_sum    = 0;
+    double   luminance_sq_sum = 0;
+    int      samples          = 0; // Taken so far.
+    int      target           = 0; // Samples it should have after the current pass.
+
+    void add(const color& c) {
+        auto y = 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+        sum += c;
+        luminance_sum += y;
+        luminance_sq_sum += y * y;
+        samples++;
+    }
+
+    // Estimated standard error of the mean luminance, relative to that mean. Pixels darker than
+    // `dark` are measured against it instead, since their relative noise is large but invisible.
+    double relative_error(double dark) const {
+        if (samples < 2)
+            return infinity;
+        auto mean = luminance_sum / samples;
+        auto variance = std::max(0.0, (luminance_sq_sum - luminance_sum * mean) / (samples - 1));
+        return std::sqrt(variance / samples) / std::max(mean, dark);
+    }
+};
+
+// What a render did, for the log and benchmarks.
+struct render_stats {
+    std::vector<scheduler_thread_stats> scheduler;
+    path_stats paths;
+    int passes = 0;             // Sample passes that traced anything: 1 unless adaptive, progressive or out of time.
+    uint64_t samples = 0;       // Camera samples over all pixels.
+    uint64_t converged = 0;     // Pixels that reached the adaptive error target.
+    int min_samples = 0, max_samples = 0; // Fewest and most samples any pixel got.
+    bool timed_out = false;     // Stopped by the camera's time_limit.
+};
 
 class camera {
   public:
@@ -23,6 +82,7 @@ class camera {
     int    image_width       = 100;  
     int    samples_per_pixel = 10;   
     int    max_depth         = 10;   
+    int    roulette_depth    = 3;    // Bounces before Russian roulette may end a path. 0 never ends one early.
 
     double vfov     = 90;              
     point3 lookfrom = point3(0,0,-1);  
@@ -31,91 +91,204 @@ class camera {
 
     double defocus_angle = 0;  
     double focus_dist = 10;    
+
+    // Threads that render() hands its tiles to. Share one pool across frames and renders, so threads
+    // are not created and joined for every image. Without a pool, render() starts num_threads threads
+    // of its own (0 means one per hardware thread) and stops them when it returns.
+    shared_ptr<thread_pool> pool;
+    int    num_threads = 0;
+
+    // Optional copies of the world, one per NUMA node of the pool, each made by a thread of that node so
+    // it sits in local memory. Threads trace their node's copy; when empty, all trace render()'s world.
+    std::vector<shared_ptr<hittable>> node_worlds;
+
+    // Random numbers of every path are keyed by these and the pixel, sample and bounce (see rng_key), so
+    // a render only depends on them and the scene: not on the thread count or the order blocks finish.
+    uint64_t seed  = 0;
+    int      frame = 0;
+
+    sampler_type sampling = sampler_type::sobol; // Where the random decisions of each path come from.
     
-struct WorkUnit {
-    int start_x;
-    int end_x;
-    int start_y;
-    int end_y;
-};
+    // Adaptive sampling, when adaptive_error > 0: samples_per_pixel becomes the average budget per
+    // pixel. A first pass gives every pixel a few samples, then each pass doubles the samples of the
+    // pixels whose relative error is still above adaptive_error, noisiest first, until all are below it,
+    // reach max_samples_per_pixel (0 means 8 x samples_per_pixel), or the budget is spent.
+    double adaptive_error        = 0;
+    int    max_samples_per_pixel = 0;
+
+    // Progressive rendering, when progressive_samples > 0: every pass adds that many samples to each
+    // pixel, up to samples_per_pixel, so the image is complete, if noisy, after the first pass. With
+    // adaptive_error > 0 as well, samples_per_pixel stays the average budget: converged pixels are
+    // skipped, and the others, noisiest first, get more samples up to max_samples_per_pixel.
+    int    progressive_samples = 0;
+    double time_limit          = 0;  // Seconds after which rendering stops and keeps the samples so far. 0 never stops.
+    std::string snapshot_path;       // If set, the image so far is written here every snapshot_interval seconds.
+    double snapshot_interval   = 10;
+
+    // Where render() writes the image, and how. An empty path writes to standard output.
+    std::string  output_path;
+    image_format output_format = image_format::p3;
+
+    // How the image is cut up and handed to the threads.
+    int        tile_size     = 8; // Tile edge in pixels.
+    tile_order tile_ordering = tile_order::hilbert;
+    double     tile_split    = 4; // Split tiles running this many times slower per pixel than usual. 0 never splits.
+
 void render(const hittable& world) {
     std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
-    initialize();
-    std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-    const int num_threads = std::thread::hardware_concurrency();
-    std::vector<std::thread> threads;
-    std::mutex qMtx;
-    std::mutex outputMtx;
-    const int blockSize = 8;
-    std::atomic<int> blocks_completed(0);
-    std::vector<std::vector<std::array<char, 32>>> imageBuffer(image_height, std::vector<std::array<char, 32>>(image_width));
-    std::queue<WorkUnit> workQueue;
-    for (int j = 0; j < image_height; j += blockSize) {
-        for (int i = 0; i < image_width; i += blockSize) {
-            WorkUnit wu = {i, std::min(i + blockSize, image_width), j, std::min(j + blockSize, image_height)};
-            workQueue.push(wu);
+    if (!initialize())
+        return;
+    framebuffer image;
+    auto stats = render_tiles(world, image, true);
+    std::chrono::duration<double> traceTime = std::chrono::high_resolution_clock::now() - startTime;
+    if (output_path.empty())
+        write_image(std::cout, image, output_format, pool.get());
+    else if (!write_image_file(output_path, image, output_format, pool.get()))
+        std::clog << "\nCould not write " << output_path << "\n";
+    std::clog << "\rDone.                 \n";
+    std::chrono::high_resolution_clock::time_point endTime = std::chrono::high_resolution_clock::now();
+    std::chrono::milliseconds elapsedTime = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
+    std::clog << "Rendering time: " << elapsedTime.count() << " milliseconds\n";
+    print_scheduler_stats(stats.scheduler);
+    print_path_stats(stats.paths, traceTime.count());
+    if (adaptive_error > 0)
+        print_adaptive_stats(stats, static_cast<uint64_t>(image_width) * image_height);
+    if (stats.timed_out && stats.samples == 0)
+        std::clog << "Time limit reached before any sample was traced: nothing was rendered\n";
+    else if (progressive_samples > 0 || stats.timed_out)
+        std::clog << (stats.timed_out ? "Time limit reached" : "Sample target reached") << " after " << stats.passes
+                  << " passes, " << static_cast<double>(stats.samples) / (static_cast<double>(image_width) * image_height)
+                  << " samples per pixel on average\n";
+}
+
+    // Renders every pixel into `image`, and returns how it went. Call initialize() first.
+    render_stats render_tiles(const hittable& world, framebuffer& image, bool progress) {
+    auto workers = pool ? pool : make_shared<thread_pool>(num_threads);
+
+    // Each NUMA node renders a horizontal band of the image, sized by its share of the threads. The
+    // band's rows are allocated by the node's own threads, so its pixels are written to local memory
+    // except for the few tiles stolen across nodes at the end. With one node the band is the image.
+    const int nodes = workers->node_count();
+    std::vector<int> band_start(nodes + 1, 0);
+    std::vector<std::vector<render_tile>> node_tiles(nodes);
+    int threads_before = 0;
+    for (int n = 0; n < nodes; n++) {
+        threads_before += workers->node_size(n);
+        band_start[n + 1] = static_cast<int>(static_cast<long long>(image_height) * threads_before / workers->size());
+        for (auto tile : make_tiles(image_width, band_start[n + 1] - band_start[n], tile_size, tile_ordering)) {
+            tile.y0 += band_start[n];
+            tile.y1 += band_start[n];
+            node_tiles[n].push_back(tile);
         }
     }
-    for (int t = 0; t < num_threads; t++) {
-        threads.push_back(std::thread([this, &world, &qMtx, &outputMtx, &workQueue, &blocks_completed, &imageBuffer]() {           
-             while (true) {
-                WorkUnit wu;
-                {
-                    std::lock_guard<std::mutex> lock(qMtx);
-                    if (workQueue.empty()) {
-                        break;
-                    }
-                    wu = workQueue.front();
-                    workQueue.pop();
-                }
-                for (int j = wu.start_y; j < wu.end_y; ++j) {
-                    for (int i = wu.start_x; i < wu.end_x; ++i) {
-                        color pixel_color(0, 0, 0);
-                        for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                            ray r = get_ray(i, j);
-                            pixel_color += ray_color(r, max_depth, world);
-                        }
-                        std::ostringstream oss;  // Create a temporary string buffer.
-                        write_color(oss, pixel_color, samples_per_pixel); // Write to the buffer.
-                        std::string pixelStr = oss.str(); // Retrieve the string from the buffer.
-                        std::copy(pixelStr.begin(), pixelStr.end(), imageBuffer[j][i].begin());
-                    }
-                }
-                {
-                    std::lock_guard<std::mutex> lock(outputMtx);
-                    blocks_completed.fetch_add(1);
-                    std::clog << "\rBlocks completed: " << blocks_completed.load() << "/" << (image_width * image_height) / (blockSize * blockSize) << std::flush;
-                }
-            }
-        }));
+    image = framebuffer(image_width, image_height);
+    pixel_plane<pixel_estimate> estimates(image_width, image_height);
+    workers->run([&workers, &band_start, &image, &estimates](int t) {
+        auto first = first_band_row(*workers, band_start, t), last = first_band_row(*workers, band_start, t + 1);
+        image.fill_rows(first, last, rgba{0, 0, 0, 0});
+        estimates.fill_rows(first, last, pixel_estimate());
+    });
+
+    render_stats stats;
+    stats.scheduler.resize(workers->size());
+    const long long budget = static_cast<long long>(image_width) * image_height * samples_per_pixel;
+    std::atomic<long long> samples_completed(0);
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto deadline = time_limit > 0
+        ? start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(time_limit))
+        : std::chrono::steady_clock::time_point::max();
+    auto last_snapshot = start;
+
+    // The first pass: every sample, or the first few when progressive or adaptive.
+    int first_pass = samples_per_pixel;
+    if (progressive_samples > 0)
+        first_pass = std::min(samples_per_pixel, progressive_samples);
+    else if (adaptive_error > 0)
+        first_pass = adaptive_first_pass < samples_per_pixel ? adaptive_first_pass : samples_per_pixel;
+    for (int j = 0; j < image_height; j++)
+        for (auto e = estimates.row(j); e != estimates.row(j + 1); ++e)
+            e->target = first_pass;
+
+    bool more = true;
+    while (more) {
+        auto samples_before = samples_completed.load();
+        trace_pass(world, *workers, node_tiles, estimates, image, stats, samples_completed, budget, deadline, progress);
+        if (samples_completed.load() > samples_before)
+            stats.passes++; // A pass cut short by the time limit before it traced anything does not count.
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            stats.timed_out = true;
+            break;
+        }
+        if (!snapshot_path.empty() && std::chrono::duration<double>(now - last_snapshot).count() >= snapshot_interval) {
+            write_snapshot(snapshot_path, image, workers.get());
+            last_snapshot = now;
+        }
+        if (progressive_samples > 0)
+            more = plan_progressive_pass(estimates, budget - samples_completed) > 0;
+        else if (adaptive_error > 0)
+            more = plan_adaptive_pass(estimates, budget - samples_completed) > 0;
+        else
+            more = false;
     }
-    for (std::thread& t : threads) {
-        t.join();
+    stats.samples = static_cast<uint64_t>(samples_completed);
+
+    stats.min_samples = std::numeric_limits<int>::max();
+    for (int j = 0; j < image_height; j++) {
+        for (auto e = estimates.row(j); e != estimates.row(j + 1); ++e) {
+            stats.min_samples = std::min(stats.min_samples, e->samples);
+            stats.max_samples = std::max(stats.max_samples, e->samples);
+            if (e->relative_error(adaptive_dark) <= adaptive_error)
+                stats.converged++;
+        }
+    }
+    return stats;
     }
-    for (const std::vector<std::array<char, 32>>& row : imageBuffer) {
-        for (const std::array<char, 32>& cell : row) {
-            std::cout.write(&cell[0], std::strlen(&cell[0]));
+
+    // Summary of how the tiles were spread over the threads.
+    static void print_scheduler_stats(const std::vector<scheduler_thread_stats>& stats) {
+        uint64_t tiles = 0, steals = 0, failed_steals = 0, splits = 0;
+        double idle = 0, max_idle = 0;
+        for (const auto& s : stats) {
+            tiles += s.tiles;
+            steals += s.steals;
+            failed_steals += s.failed_steals;
+            splits += s.splits;
+            idle += s.idle_seconds;
+            max_idle = std::max(max_idle, s.idle_seconds);
         }
+        std::clog << "Scheduler: " << tiles << " tiles on " << stats.size() << " threads, " << steals
+                  << " stolen (" << failed_steals << " failed steal attempts), " << splits << " split, idle " << 1000 * idle
+                  << " ms in total, " << 1000 * max_idle << " ms at most per thread\n";
     }
-    std::clog << "\rDone.                 \n";
-    std::chrono::high_resolution_clock::time_point endTime = std::chrono::high_resolution_clock::now();
-    std::chrono::milliseconds elapsedTime = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
-    std::clog << "Rendering time: " << elapsedTime.count() << " milliseconds\n";
-}
 
-private:
-    int    image_height;   
-    point3 center;          
-    point3 pixel00_loc;     
-    vec3   pixel_delta_u;   
-    vec3   pixel_delta_v;   
-    vec3   u, v, w;         
-    vec3   defocus_disk_u;  
-    vec3   defocus_disk_v;  
+    static void print_adaptive_stats(const render_stats& stats, uint64_t pixels) {
+        std::clog << "Adaptive sampling: " << stats.passes << " passes, "
+                  << static_cast<double>(stats.samples) / pixels << " samples per pixel on average (fewest "
+                  << stats.min_samples << ", most " << stats.max_samples << "), "
+                  << 100.0 * stats.converged / pixels << "% of pixels converged\n";
+    }
 
-    void initialize() {
+    static void print_path_stats(const path_stats& paths, double seconds) {
+        if (paths.paths == 0)
+            return; // Nothing was traced, e.g. the time limit ran out first.
+        std::clog << "Paths: " << static_cast<double>(paths.rays) / paths.paths << " rays on average, "
+                  << 100.0 * paths.roulette / paths.paths << "% ended by Russian roulette, "
+                  << paths.rays / seconds / 1e6 << " Mrays/s\n";
+    }
+
+    // Derives the viewport from the settings above. render() calls it; benchmarks that trace their own
+    // rays with center_ray() must call it first. Returns false, and says why, for images too large to
+    // render in tiles.
+    bool initialize() {
         image_height = static_cast<int>(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
+        if (image_width > max_image_side || image_height > max_image_side) {
+            std::clog << "Image of " << image_width << "x" << image_height << " pixels is too large: at most "
+                      << max_image_side << " pixels per side are supported\n";
+            return false;
+        }
 
         center = lookfrom;
 
@@ -140,52 +313,255 @@ private:
         auto defocus_radius = focus_dist * tan(degrees_to_radians(defocus_angle / 2));
         defocus_disk_u = u * defocus_radius;
         defocus_disk_v = v * defocus_radius;
+        return true;
+    }
+
+    int height() const { return image_height; }
+
+    // Ray from the camera center through the center of pixel (i, j), without jitter or defocus blur.
+    ray center_ray(int i, int j) const {
+        auto pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
+        return ray(center, pixel_center - center);
+    }
+
+private:
+    int    image_height;   
+    point3 center;          
+    point3 pixel00_loc;     
+    vec3   pixel_delta_u;   
+    vec3   pixel_delta_v;   
+    vec3   u, v, w;         
+    vec3   defocus_disk_u;  
+    vec3   defocus_disk_v;  
+
+    static const int adaptive_first_pass = 16;   // Samples every pixel gets before any is judged converged.
+    static constexpr double adaptive_dark = 0.05; // Luminance below which errors are measured as absolute.
+
+    // First row of the rows thread t allocates and finishes: its share of its node's band. The share
+    // of thread t ends where that of thread t + 1 begins, also across nodes, which start new bands.
+    static int first_band_row(const thread_pool& workers, const std::vector<int>& band_start, int t) {
+        if (t == workers.size())
+            return band_start.back();
+        auto n = workers.node_of(t);
+        auto rows = band_start[n + 1] - band_start[n];
+        return band_start[n] + rows * workers.rank_in_node(t) / workers.node_size(n);
+    }
+
+    // Brings every pixel up to its target sample count, tile by tile on all threads.
+    void trace_pass(const hittable& world, thread_pool& workers, const std::vector<std::vector<render_tile>>& node_tiles,
+                    pixel_plane<pixel_estimate>& estimates, framebuffer& image, render_stats& stats,
+                    std::atomic<long long>& samples_completed, long long budget,
+                    std::chrono::steady_clock::time_point deadline, bool progress) const {
+        tile_scheduler scheduler(node_tiles, workers.thread_node_list(), tile_split);
+        std::vector<path_stats> thread_paths(workers.size());
+        std::mutex outputMtx;
+
+        const uint64_t frame_key = rng_key(seed, static_cast<uint64_t>(frame));
+        workers.run([this, frame_key, budget, deadline, progress, &workers, &world, &scheduler, &thread_paths, &outputMtx, &samples_completed, &estimates, &image](int t) {
+            const hittable& thread_world = node_worlds.empty() ? world : *node_worlds[workers.node_of(t)];
+            auto pixel_sampler = make_sampler(sampling);
+            path_stats paths;
+            render_tile wu;
+            while (scheduler.next(t, wu)) {
+                auto tile_start = std::chrono::steady_clock::now();
+                if (tile_start >= deadline) {
+                    scheduler.stop(t); // Out of time: leave this tile and the rest as they are.
+                    break;
+                }
+                long long tile_samples = 0;
+                for (int j = wu.y0; j < wu.y1; ++j) {
+                    for (int i = wu.x0; i < wu.x1; ++i) {
+                        auto& e = estimates(i, j);
+                        auto pixel_key = rng_key(frame_key, static_cast<uint64_t>(j) * image_width + i);
+                        tile_samples += e.target - e.samples;
+                        for (int sample = e.samples; sample < e.target; ++sample) {
+                            pixel_sampler->start_sample(pixel_key, static_cast<uint32_t>(sample));
+                            ray r = get_ray(i, j, *pixel_sampler);
+                            e.add(ray_color(r, thread_world, *pixel_sampler, paths));
+                        }
+                        if (e.samples > 0) {
+                            auto mean = e.sum / e.samples;
+                            image(i, j) = rgba{static_cast<float>(mean.x()), static_cast<float>(mean.y()),
+                                               static_cast<float>(mean.z()), 1.0f};
+                        }
+                    }
+                    scheduler.split_if_slow(t, wu, j + 1 - wu.y0, seconds_since(tile_start));
+                }
+                scheduler.tile_done(t, wu, seconds_since(tile_start));
+
+                // Report progress unless another thread is already printing; never wait for the lock.
+                auto completed = samples_completed.fetch_add(tile_samples) + tile_samples;
+                std::unique_lock<std::mutex> lock(outputMtx, std::try_to_lock);
+                if (progress && lock.owns_lock())
+                    std::clog << "\rSamples completed: " << 100 * completed / budget << "%" << std::flush;
+            }
+            thread_paths[t] = paths;
+        });
+        scheduler.finish();
+
+        for (size_t t = 0; t < thread_paths.size(); t++) {
+            stats.scheduler[t].add(scheduler.stats()[t]);
+            stats.paths.add(thread_paths[t]);
+        }
+    }
+
+    // Sets the targets of the next progressive pass: progressive_samples more for every pixel short of
+    // samples_per_pixel. When adaptive, only for pixels that have not converged, up to the adaptive
+    // cap, noisiest first as long as `remaining` samples last. Returns the samples planned.
+    long long plan_progressive_pass(pixel_plane<pixel_estimate>& estimates, long long remaining) const {
+        long long planned = 0;
+        if (adaptive_error <= 0) {
+            for (int j = 0; j < image_height; j++) {
+                for (auto e = estimates.row(j); e != estimates.row(j + 1); ++e) {
+                    e->target = std::min(samples_per_pixel, e->samples + progressive_samples);
+                    planned += e->target - e->samples;
+                }
+            }
+            return planned;
+        }
+
+        const int cap = adaptive_cap();
+        std::vector<std::pair<double, pixel_estimate*>> noisy;
+        for (int j = 0; j < image_height; j++) {
+            for (auto e = estimates.row(j); e != estimates.row(j + 1); ++e) {
+                e->target = e->samples;
+                auto error = e->relative_error(adaptive_dark);
+                if ((e->samples < adaptive_first_pass || error > adaptive_error) && e->samples < cap)
+                    noisy.push_back(std::make_pair(error, e));
+            }
+        }
+        std::sort(noisy.begin(), noisy.end(),
+                  [](const std::pair<double, pixel_estimate*>& a, const std::pair<double, pixel_estimate*>& b) {
+                      return a.first > b.first;
+                  });
+
+        for (const auto& n : noisy) {
+            auto extra = std::min<long long>(std::min(progressive_samples, cap - n.second->samples), remaining - planned);
+            if (extra <= 0)
+                break;
+            n.second->target += static_cast<int>(extra);
+            planned += extra;
+        }
+        return planned;
+    }
+
+    // Most samples adaptive sampling gives one pixel.
+    int adaptive_cap() const {
+        return max_samples_per_pixel > 0 ? max_samples_per_pixel : 8 * samples_per_pixel;
+    }
+
+    // Writes the image so far to `path`, in the format its extension asks for (for .ppm, P6 if that is
+    // the output format, else P3; P3 for unknown extensions), compressing on the idle `workers`. It
+    // goes to a temporary file first and is then renamed over `path`, so readers never see half an image.
+    void write_snapshot(const std::string& path, const framebuffer& image, thread_pool* workers) const {
+        auto temporary = path + ".tmp";
+        auto format = image_format_for(path, output_format == image_format::p6 ? image_format::p6 : image_format::p3,
+                                       image_format::p3);
+        if (!write_image_file(temporary, image, format, workers)) {
+            std::clog << "\nCould not write snapshot " << temporary << "\n";
+            return;
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0)
+            std::clog << "\nCould not replace snapshot " << path << "\n";
     }
 
-    ray get_ray(int i, int j) const {
+    // Sets the targets of the next adaptive pass: pixels still above the error target double their
+    // samples, noisiest first, as long as `remaining` samples last. Returns the samples planned.
+    long long plan_adaptive_pass(pixel_plane<pixel_estimate>& estimates, long long remaining) const {
+        const int cap = adaptive_cap();
+        std::vector<std::pair<double, pixel_estimate*>> noisy;
+        for (int j = 0; j < image_height; j++) {
+            for (auto e = estimates.row(j); e != estimates.row(j + 1); ++e) {
+                e->target = e->samples;
+                auto error = e->relative_error(adaptive_dark);
+                if (error > adaptive_error && e->samples < cap)
+                    noisy.push_back(std::make_pair(error, e));
+            }
+        }
+        std::sort(noisy.begin(), noisy.end(),
+                  [](const std::pair<double, pixel_estimate*>& a, const std::pair<double, pixel_estimate*>& b) {
+                      return a.first > b.first;
+                  });
+
+        long long planned = 0;
+        for (const auto& n : noisy) {
+            auto extra = std::min<long long>(std::min(n.second->samples, cap - n.second->samples), remaining - planned);
+            if (extra <= 0)
+                break;
+            n.second->target += static_cast<int>(extra);
+            planned += extra;
+        }
+        return planned;
+    }
+
+    static double seconds_since(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    ray get_ray(int i, int j, sampler& s) const {
 
         auto pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
-        auto pixel_sample = pixel_center + pixel_sample_square();
+        auto pixel_sample = pixel_center + pixel_sample_square(s.get_2d());
 
-        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample(s.get_2d());
         auto ray_direction = pixel_sample - ray_origin;
 
         return ray(ray_origin, ray_direction);
     }
 
-    vec3 pixel_sample_square() const {
-        auto px = -0.5 + random_double();
-        auto py = -0.5 + random_double();
+    vec3 pixel_sample_square(const sample_2d& s) const {
+        auto px = -0.5 + s.u;
+        auto py = -0.5 + s.v;
         return (px * pixel_delta_u) + (py * pixel_delta_v);
     }
 
-    vec3 pixel_sample_disk(double radius) const {
-        auto p = radius * random_in_unit_disk();
+    vec3 pixel_sample_disk(double radius, const sample_2d& s) const {
+        auto p = radius * sample_in_unit_disk(s);
         return (p[0] * pixel_delta_u) + (p[1] * pixel_delta_v);
     }
 
-    point3 defocus_disk_sample() const {
-        auto p = random_in_unit_disk();
+    point3 defocus_disk_sample(const sample_2d& s) const {
+        auto p = sample_in_unit_disk(s);
         return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 
-    color ray_color(const ray& r, int depth, const hittable& world) const {
-        if (depth <= 0)
-            return color(0,0,0);
+    // Follows one path from the camera, keeping the product of the attenuations so far as its
+    // throughput. After roulette_depth bounces a path survives each further bounce only with a
+    // probability that falls with its throughput, and survivors are weighted up by its inverse: the
+    // expected color is unchanged, but dim paths, which add little, stop early.
+    color ray_color(const ray& camera_ray, const hittable& world, sampler& s, path_stats& stats) const {
+        ray r = camera_ray;
+        color throughput(1, 1, 1);
+        stats.paths++;
 
-        hit_record rec;
+        for (int bounce = 0; bounce < max_depth; bounce++) {
+            hit_record rec;
+            stats.rays++;
+            if (!world.hit(r, interval(0.001, infinity), rec)) {
+                vec3 unit_direction = unit_vector(r.direction());
+                auto a = 0.5*(unit_direction.y() + 1.0);
+                return throughput * ((1.0-a)*color(1.0, 1.0, 1.0) + a*color(0.5, 0.7, 1.0));
+            }
 
-        if (world.hit(r, interval(0.001, infinity), rec)) {
             ray scattered;
             color attenuation;
-            if (rec.mat->scatter(r, rec, attenuation, scattered))
-                return attenuation * ray_color(scattered, depth-1, world);
-            return color(0,0,0);
-        }
+            s.start_bounce(bounce);
+            if (!rec.mat->scatter(r, rec, attenuation, scattered, s))
+                return color(0,0,0);
+            throughput = throughput * attenuation;
 
-        vec3 unit_direction = unit_vector(r.direction());
-        auto a = 0.5*(unit_direction.y() + 1.0);
-        return (1.0-a)*color(1.0, 1.0, 1.0) + a*color(0.5, 0.7, 1.0);
+            if (roulette_depth > 0 && bounce + 1 >= roulette_depth) {
+                // Capped below 1, so paths that lose nothing, e.g. inside glass, still end.
+                auto survival = fmin(fmax(throughput.x(), fmax(throughput.y(), throughput.z())), 0.95);
+                if (s.get_roulette(bounce) >= survival) {
+                    stats.roulette++;
+                    return color(0,0,0);
+                }
+                throughput /= survival;
+            }
+            r = scattered;
+        }
+        return color(0,0,0);
     }
 };
 
@@ -0,0 +1,77 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+// Runtime CPU feature detection for the vectorized kernels.
+// Kernels for wider instruction sets are compiled with per-function target attributes, so the program
+// itself builds for the baseline architecture and picks the widest kernel the CPU supports at startup.
+
+#if defined(__x86_64__) || defined(_M_X64)
+    #define RT_X86_64 1
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
+#endif
+
+#if defined(RT_X86_64) && (defined(__GNUC__) || defined(__clang__))
+    #define RT_TARGET_AVX2   __attribute__((target("avx2,fma")))
+    #define RT_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+    #define RT_TARGET_AVX2
+    #define RT_TARGET_AVX512
+#endif
+
+// Instruction sets the kernels know about, from narrowest to widest.
+enum class simd_level { scalar = 0, sse = 1, avx2 = 2, avx512 = 3 };
+
+inline const char* simd_level_name(simd_level level) {
+    switch (level) {
+        case simd_level::sse:    return "sse";
+        case simd_level::avx2:   return "avx2";
+        case simd_level::avx512: return "avx512";
+        default:                 return "scalar";
+    }
+}
+
+// Widest instruction set both the CPU and the operating system support.
+inline simd_level detect_simd_level() {
+#if defined(RT_X86_64) && (defined(__GNUC__) || defined(__clang__))
+    // These builtins also check that the OS saves the wide registers on context switches.
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return simd_level::avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return simd_level::avx2;
+    return simd_level::sse; // SSE2 is part of x86-64.
+#elif defined(RT_X86_64) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool os_saves_ymm = (info[2] & (1 << 27)) && ((_xgetbv(0) & 0x6) == 0x6);
+    bool fma = (info[2] & (1 << 12)) != 0;
+    __cpuidex(info, 7, 0);
+    bool avx2 = (info[1] & (1 << 5)) != 0;
+    bool avx512f = (info[1] & (1 << 16)) != 0;
+    if (os_saves_ymm && avx512f && ((_xgetbv(0) & 0xe6) == 0xe6))
+        return simd_level::avx512;
+    if (os_saves_ymm && avx2 && fma)
+        return simd_level::avx2;
+    return simd_level::sse;
+#else
+    return simd_level::scalar;
+#endif
+}
+
+// Upper limit on the instruction set kernels may use, e.g. to force the scalar paths for comparison.
+inline simd_level& simd_level_cap() {
+    static simd_level cap = simd_level::avx512;
+    return cap;
+}
+
+// The instruction set kernels should use: what the machine supports, within the cap.
+inline simd_level active_simd_level() {
+    static const simd_level detected = detect_simd_level();
+    return detected < simd_level_cap() ? detected : simd_level_cap();
+}
+
+
+#endif
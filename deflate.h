@@ -0,0 +1,282 @@
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A small deflate (RFC 1951) compressor and the zlib (RFC 1950) and CRC-32 checksums around it, for the
+// PNG and OpenEXR writers. It finds matches with hash chains and codes them with the fixed Huffman
+// tables, like stb_image_write: a little larger than zlib's output, with no dependency. Independent
+// blocks compress on as many threads as there are, each thread with its own deflate_compressor.
+
+// CRC-32 of `size` bytes, continuing from `crc` (0 to start), as PNG chunks use it.
+inline uint32_t crc32(uint32_t crc, const unsigned char* data, size_t size) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t;
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+const uint32_t adler_modulus = 65521;
+
+// Adler-32 of `size` bytes, continuing from `adler` (1 to start), as zlib streams end with it.
+inline uint32_t adler32(uint32_t adler, const unsigned char* data, size_t size) {
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (size > 0) {
+        auto n = size < 5552 ? size : 5552; // The most bytes before b can overflow 32 bits.
+        size -= n;
+        while (n-- > 0) {
+            a += *data++;
+            b += a;
+        }
+        a %= adler_modulus;
+        b %= adler_modulus;
+    }
+    return a | (b << 16);
+}
+
+// The Adler-32 of two byte strings one after the other, from the checksum of each and the length of
+// the second, so the parts of a stream can be summed on different threads.
+inline uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_size) {
+    const uint64_t m = adler_modulus;
+    const uint64_t rem = second_size % m;
+    uint64_t a = (first & 0xffff) + (second & 0xffff) + m - 1;
+    uint64_t b = rem * (first & 0xffff) % m + (first >> 16) + (second >> 16) + m - rem;
+    return static_cast<uint32_t>(a % m) | (static_cast<uint32_t>(b % m) << 16);
+}
+
+// Compresses byte strings into deflate blocks. Keeps its match tables between calls, so give each
+// thread one and reuse it.
+class deflate_compressor {
+  public:
+    // Appends `data` to `out` as deflate blocks. The last part of a stream is compressed with `last`
+    // set; other parts end on a byte boundary with an empty stored block, so the parts of a stream
+    // can be compressed separately, on different threads, and then concatenated.
+    void compress(const unsigned char* data, size_t size, bool last, std::vector<unsigned char>& out) {
+        const size_t start = out.size();
+        compress_fixed(data, size, last, out);
+
+        // Data that does not compress (noise, mostly) grows under the fixed codes; store it instead.
+        const size_t stored_size = size + 5 * ((size + 65534) / 65535);
+        if (size > 0 && out.size() - start > stored_size) {
+            out.resize(start);
+            for (size_t i = 0; i < size; i += 65535) {
+                auto n = size - i < 65535 ? size - i : 65535;
+                out.push_back(last && i + n == size ? 1 : 0);
+                out.push_back(static_cast<unsigned char>(n));
+                out.push_back(static_cast<unsigned char>(n >> 8));
+                out.push_back(static_cast<unsigned char>(~n));
+                out.push_back(static_cast<unsigned char>(~n >> 8));
+                out.insert(out.end(), data + i, data + i + n);
+            }
+        }
+    }
+
+  private:
+    static const int window = 32768;     // How far back matches may start.
+    static const int hash_bits = 15;
+    static const int max_chain = 16;     // Earlier positions with the same hash tried per match.
+    static const int nice_match = 64;    // A match this long ends the search.
+    static const int min_match = 3;
+    static const int max_match = 258;
+
+    std::vector<int64_t> head;  // Latest position of each hash, or -1.
+    std::vector<int64_t> chain; // Previous position with the same hash, by position modulo the window.
+
+    // A fixed Huffman code, bit-reversed so it goes out least significant bit first like everything else.
+    struct fixed_code {
+        uint16_t bits;
+        uint8_t length;
+    };
+
+    struct code_tables {
+        fixed_code symbol[288];    // Literal bytes, the end of block (256), length codes (257-285).
+        fixed_code distance[30];
+        int length_base[29], length_extra[29];
+        int distance_base[30], distance_extra[30];
+        uint8_t length_code[max_match + 1]; // By match length.
+        uint8_t distance_code[512];         // By distance - 1 below 256, then by 256 + ((distance - 1) >> 7).
+
+        code_tables() {
+            static const int lengths[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51,
+                                             59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+            static const int distances[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                                               513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+            for (int s = 0; s < 288; s++) {
+                if (s < 144)
+                    symbol[s] = reversed(0x30 + s, 8);
+                else if (s < 256)
+                    symbol[s] = reversed(0x190 + s - 144, 9);
+                else if (s < 280)
+                    symbol[s] = reversed(s - 256, 7);
+                else
+                    symbol[s] = reversed(0xc0 + s - 280, 8);
+            }
+            for (int c = 0; c < 29; c++) {
+                length_base[c] = lengths[c];
+                length_extra[c] = c < 8 || c == 28 ? 0 : (c - 4) / 4;
+                for (int length = lengths[c]; length < (c < 28 ? lengths[c + 1] : max_match + 1); length++)
+                    length_code[length] = static_cast<uint8_t>(c);
+            }
+            for (int c = 0; c < 30; c++) {
+                distance[c] = reversed(c, 5);
+                distance_base[c] = distances[c];
+                distance_extra[c] = c < 4 ? 0 : (c - 2) / 2;
+                for (int d = distances[c] - 1; d < distances[c] - 1 + (1 << distance_extra[c]); d++)
+                    distance_code[d < 256 ? d : 256 + (d >> 7)] = static_cast<uint8_t>(c);
+            }
+        }
+
+        static fixed_code reversed(int code, int length) {
+            int bits = 0;
+            for (int i = 0; i < length; i++)
+                bits |= ((code >> i) & 1) << (length - 1 - i);
+            return fixed_code{ static_cast<uint16_t>(bits), static_cast<uint8_t>(length) };
+        }
+    };
+
+    static const code_tables& tables() {
+        static const code_tables t;
+        return t;
+    }
+
+    // Collects bits least significant first, and appends them to `out` four bytes at a time.
+    struct bit_writer {
+        std::vector<unsigned char>& out;
+        uint64_t bits;
+        int count;
+
+        void put(uint32_t value, int n) {
+            bits |= static_cast<uint64_t>(value) << count;
+            count += n;
+            if (count >= 32) {
+                unsigned char bytes[4] = { static_cast<unsigned char>(bits), static_cast<unsigned char>(bits >> 8),
+                                           static_cast<unsigned char>(bits >> 16), static_cast<unsigned char>(bits >> 24) };
+                out.insert(out.end(), bytes, bytes + 4);
+                bits >>= 32;
+                count -= 32;
+            }
+        }
+
+        void put(fixed_code code) { put(code.bits, code.length); }
+
+        // Pads to a byte boundary and appends what is left.
+        void flush() {
+            for (; count > 0; count -= 8) {
+                out.push_back(static_cast<unsigned char>(bits));
+                bits >>= 8;
+            }
+            bits = 0;
+            count = 0;
+        }
+    };
+
+    static uint32_t hash(const unsigned char* p) {
+        auto v = static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16);
+        return (v * 2654435761u) >> (32 - hash_bits);
+    }
+
+    void insert(const unsigned char* data, int64_t pos) {
+        auto h = hash(data + pos);
+        chain[pos & (window - 1)] = head[h];
+        head[h] = pos;
+    }
+
+    void compress_fixed(const unsigned char* data, size_t size, bool last, std::vector<unsigned char>& out) {
+        const code_tables& codes = tables();
+        head.assign(size_t(1) << hash_bits, -1);
+        chain.resize(window);
+        out.reserve(out.size() + size + size / 8 + 16); // Room for every byte as a 9-bit literal.
+
+        bit_writer bits = { out, 0, 0 };
+        bits.put(last ? 1 : 0, 1); // BFINAL
+        bits.put(1, 2);            // BTYPE: fixed Huffman codes
+        const auto n = static_cast<int64_t>(size);
+        int64_t i = 0;
+        while (i < n) {
+            int best_length = 0;
+            int64_t best_distance = 0;
+            if (i + min_match <= n) {
+                const int longest = static_cast<int>(n - i < max_match ? n - i : max_match);
+                auto candidate = head[hash(data + i)];
+                for (int tries = 0; candidate >= 0 && i - candidate <= window && tries < max_chain; tries++) {
+                    if (data[candidate + best_length] == data[i + best_length]) {
+                        int length = 0;
+                        while (length < longest && data[candidate + length] == data[i + length])
+                            length++;
+                        if (length > best_length) {
+                            best_length = length;
+                            best_distance = i - candidate;
+                            if (length == longest || length >= nice_match)
+                                break;
+                        }
+                    }
+                    candidate = chain[candidate & (window - 1)];
+                }
+            }
+
+            if (best_length < min_match) {
+                bits.put(codes.symbol[data[i]]);
+                if (i + min_match <= n)
+                    insert(data, i);
+                i++;
+                continue;
+            }
+
+            int code = codes.length_code[best_length];
+            bits.put(codes.symbol[257 + code]);
+            bits.put(static_cast<uint32_t>(best_length - codes.length_base[code]), codes.length_extra[code]);
+            auto d = best_distance - 1;
+            code = codes.distance_code[d < 256 ? d : 256 + (d >> 7)];
+            bits.put(codes.distance[code]);
+            bits.put(static_cast<uint32_t>(best_distance - codes.distance_base[code]), codes.distance_extra[code]);
+
+            for (auto end = i + best_length; i < end; i++)
+                if (i + min_match <= n)
+                    insert(data, i);
+        }
+        bits.put(codes.symbol[256]); // End of block.
+        if (!last) {
+            bits.put(0, 3); // An empty stored block, which realigns the stream to a byte boundary.
+            bits.flush();
+            const unsigned char empty[4] = { 0x00, 0x00, 0xff, 0xff };
+            out.insert(out.end(), empty, empty + 4);
+        }
+        bits.flush();
+    }
+};
+
+// The two bytes that open a zlib stream: deflate with a 32 KiB window, no preset dictionary.
+inline void append_zlib_header(std::vector<unsigned char>& out) {
+    out.push_back(0x78);
+    out.push_back(0x01);
+}
+
+// The Adler-32 that closes a zlib stream, most significant byte first.
+inline void append_zlib_trailer(std::vector<unsigned char>& out, uint32_t adler) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<unsigned char>(adler >> shift));
+}
+
+// Appends `data` to `out` as a complete zlib stream.
+inline void zlib_compress(deflate_compressor& compressor, const unsigned char* data, size_t size,
+                          std::vector<unsigned char>& out) {
+    append_zlib_header(out);
+    compressor.compress(data, size, true, out);
+    append_zlib_trailer(out, adler32(1, data, size));
+}
+
+
+#endif
@@ -0,0 +1,869 @@
+#ifndef FLAT_BVH_H
+#define FLAT_BVH_H
+
+#include "rtweekend.h"
+#include "aligned_allocator.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "lbvh.h"
+#include "parallel.h"
+#include "sbvh.h"
+#include "sphere.h"
+#include "sphere_soa.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// One node of a flat_bvh, packed into 32 bytes so two nodes share a cache line.
+// Nodes are stored in depth-first order: an interior node's first child immediately follows it,
+// so only the index of the second child has to be stored.
+struct flat_bvh_node {
+    float    bounds_min[3];
+    float    bounds_max[3];
+    uint32_t offset; // Leaf: index of the first primitive. Interior: index of the second child.
+    uint16_t count;  // Number of primitives in a leaf, 0 for interior nodes.
+    uint16_t axis;   // Split axis of an interior node, used to visit the nearer child first.
+
+    bool is_leaf() const { return count > 0; }
+};
+
+static_assert(sizeof(flat_bvh_node) == 32, "flat_bvh_node must stay 32 bytes");
+
+// Deepest tree the traversal stack can handle. The builder falls back to median splits near this limit.
+const int flat_bvh_max_depth = 64;
+
+// Rounds a double to the nearest float that does not shrink the box: bounds must stay conservative.
+inline float round_down_to_float(double x) {
+    auto f = static_cast<float>(x);
+    return (f > x) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float round_up_to_float(double x) {
+    auto f = static_cast<float>(x);
+    return (f < x) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+
+// Algorithm used to build a flat_bvh.
+enum class bvh_builder {
+    sah,  // Top-down binned SAH: the best trees, but the slowest build.
+    lbvh, // Morton-code linear BVH: builds several times faster, trees are somewhat worse.
+    sbvh  // SAH with spatial splits: better trees around large primitives, at the cost of a slower,
+          // single-threaded build and some primitives referenced from more than one leaf.
+};
+
+struct bvh_build_options {
+    bvh_builder builder = bvh_builder::sah;
+    int num_threads     = 1;
+    int morton_bits     = 30; // LBVH code length: 30 (32-bit codes) or 63 (64-bit codes, for huge or sparse scenes).
+};
+
+
+// Work counted by flat_bvh::hit for a batch of rays.
+struct traversal_stats {
+    uint64_t rays = 0;
+    uint64_t nodes = 0;      // Nodes whose box was tested.
+    uint64_t primitives = 0; // Primitive intersection tests.
+};
+
+// Pointer-free bounding volume hierarchy.
+// Built with the same binned SAH as bvh_node, but laid out as one contiguous array of 32-byte nodes that
+// reference children by index, with the primitives stored contiguously in leaf order. Traversal is a loop
+// over that array with a fixed-size stack: no shared_ptr copies and no virtual calls until a leaf is reached.
+class flat_bvh : public hittable {
+  public:
+    flat_bvh(const hittable_list& list, const bvh_build_options& options = bvh_build_options()) {
+        build(list.objects, options);
+    }
+
+    // Adopts an already built tree over `list`, e.g. one loaded from a bvh_cache file: `node_data` holds
+    // `count` nodes, and `order` the index in `list` of each of the `references` leaf primitives, in leaf
+    // order. The caller must have checked that they are consistent with each other and with `list`.
+    flat_bvh(const hittable_list& list, const flat_bvh_node* node_data, size_t count, const uint32_t* order,
+             size_t references, const bvh_build_options& options = bvh_build_options()) : options(options) {
+        leaf_batch = leaf_batch_for(list.objects);
+        sources = list.objects;
+        nodes.assign(node_data, node_data + count);
+        set_leaf_order(list.objects, std::vector<uint32_t>(order, order + references));
+        if (count > 0)
+            bbox = root_bounds();
+    }
+
+    // Updates the tree after its primitives have moved (e.g. sphere centers between animation frames),
+    // keeping the topology: leaf bounds are recomputed from the primitives, then every interior node from
+    // its children. Since children always come after their parent, that is one backwards sweep; it is
+    // split into independent subtrees that are refit in parallel before the few nodes above them.
+    // Returns the SAH cost growth, i.e. the tree's SAH cost relative to when it was built. Leaves of an
+    // SBVH tree are refit to whole primitives, so they lose the tighter bounds of their spatial splits.
+    double refit(int num_threads = 1) {
+        if (nodes.empty())
+            return 1;
+
+        std::vector<uint32_t> tasks, top;
+        split_for_refit(static_cast<size_t>(num_threads < 1 ? 1 : num_threads) * 8, tasks, top);
+
+        std::atomic<size_t> next_task(0);
+        auto chunks = static_cast<int>(tasks.size() < static_cast<size_t>(num_threads) ? tasks.size() : num_threads);
+        parallel_chunks(tasks.size(), chunks < 1 ? 1 : chunks, [&](int, size_t, size_t) {
+            // Subtrees vary a lot in size, so threads pull them one at a time rather than in fixed chunks.
+            for (auto t = next_task.fetch_add(1); t < tasks.size(); t = next_task.fetch_add(1)) {
+                auto first = tasks[t];
+                for (auto i = subtree_end(first); i-- > first; )
+                    refit_node(i);
+            }
+        });
+
+        // `top` lists the expanded nodes parents-first, so walk it backwards.
+        for (auto it = top.rbegin(); it != top.rend(); ++it)
+            refit_node(*it);
+
+        bbox = root_bounds();
+        if (sphere_leaves)
+            leaf_spheres.update_bounds(); // Once, here: the parallel sweep only copies centers and radii.
+        return cost_growth();
+    }
+
+    // Rebuilds the tree from scratch over the same primitives, with the options it was built with.
+    // It starts from the source list rather than the leaf-order one, which holds SBVH duplicates and
+    // which leaf_order() does not index.
+    void rebuild() {
+        auto current = sources;
+        build(current, options);
+    }
+
+    // Refits the tree, or rebuilds it when refitting has made it more than `max_cost_growth` times as
+    // expensive to traverse as right after its last build or rebuild (see cost_growth). Moving primitives
+    // stretch the boxes of their ancestors, so refitted trees slowly degrade; this keeps the cheap path
+    // until the degradation is worth a rebuild.
+    // Returns true if the tree was rebuilt.
+    bool refit_or_rebuild(double max_cost_growth) {
+        if (refit(options.num_threads) <= max_cost_growth)
+            return false;
+        rebuild();
+        return true;
+    }
+
+    // SAH cost relative to the cost right after the last build.
+    double cost_growth() const {
+        return built_cost > 0 ? sah_cost() / built_cost : 1;
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return traverse<false>(r, ray_t, rec, nullptr);
+    }
+
+    // Same as hit, but also counts the work done into `stats`, for comparing trees.
+    bool hit(const ray& r, interval ray_t, hit_record& rec, traversal_stats& stats) const {
+        stats.rays++;
+        return traverse<true>(r, ray_t, rec, &stats);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t node_count() const { return nodes.size(); }
+
+    // Expected cost of a ray through the tree under the SAH model, in units of one primitive test (or
+    // one batch of sphere tests, see leaf_batch_for): every node is weighted by the chance that a ray
+    // through the root also passes through it.
+    // Lower is better; it is how builders are compared on tree quality.
+    double sah_cost() const {
+        if (nodes.empty())
+            return 0;
+        auto root_area = node_area(nodes[0]);
+        if (root_area <= 0)
+            return 0;
+
+        double cost = 0;
+        for (const auto& node : nodes) {
+            auto weight = node_area(node) / root_area;
+            cost += node.is_leaf() ? weight * leaf_cost(node.count) : weight * bvh_traversal_cost;
+        }
+        return cost;
+    }
+
+    // Read-only views of the tree, for structures derived from it (see wide_bvh).
+    const flat_bvh_node& node(size_t i) const { return nodes[i]; }
+    const std::vector<shared_ptr<hittable>>& leaf_objects() const { return objects; }
+    // The primitives as SIMD-friendly sphere arrays in leaf order, or null if they are not all spheres.
+    const sphere_soa* sphere_leaf_storage() const { return sphere_leaves ? &leaf_spheres : nullptr; }
+    // Source list index of each leaf primitive. SBVH trees may list a primitive more than once.
+    const std::vector<uint32_t>& leaf_order() const { return order; }
+
+    // Primitives a leaf over `objects` tests at the price of one: the SIMD batch width when they are all
+    // spheres (see sphere_soa), 1 otherwise. Trees are built with leaves sized to it, so it depends on the
+    // CPU as well as on the scene.
+    static size_t leaf_batch_for(const std::vector<shared_ptr<hittable>>& objects) {
+        for (const auto& object : objects)
+            if (!dynamic_cast<const sphere*>(object.get()))
+                return 1;
+        return objects.empty() ? 1 : sphere_soa::batch_width();
+    }
+
+  private:
+    typedef std::vector<flat_bvh_node, aligned_allocator<flat_bvh_node, cache_line_size>> node_array;
+
+    node_array nodes;
+    std::vector<const hittable*> primitives; // Leaf order. Raw pointers, so tracing never touches refcounts.
+    std::vector<shared_ptr<hittable>> objects; // Owns the primitives, in the same order.
+    std::vector<uint32_t> order;               // Index of each primitive in the source list...
+    std::vector<shared_ptr<hittable>> sources; // ...which is kept, in its own order, for rebuilds.
+    sphere_soa leaf_spheres;                   // Copies of the primitives, when they are all spheres...
+    bool sphere_leaves = false;                // ...so leaves test them in SIMD batches instead of one by one.
+    size_t leaf_batch = 1;                     // See leaf_batch_for.
+    aabb bbox;
+    bvh_build_options options; // How the tree was built, for rebuilds.
+    double built_cost = 0;     // SAH cost right after the last build.
+    double sbvh_root_area = 0; // Surface area of the root during an SBVH build.
+
+    aabb root_bounds() const {
+        const auto& root = nodes[0];
+        return aabb(point3(root.bounds_min[0], root.bounds_min[1], root.bounds_min[2]),
+                    point3(root.bounds_max[0], root.bounds_max[1], root.bounds_max[2]));
+    }
+
+    // The traversal loop behind both hit() overloads. CountSteps is a template parameter so that the
+    // plain hit() compiles without any of the counting.
+    template <bool CountSteps>
+    bool traverse(const ray& r, interval ray_t, hit_record& rec, traversal_stats* stats) const {
+        if (nodes.empty())
+            return false;
+
+        // Node bounds are floats, so the slab tests run in float too.
+        float origin[3], inv_dir[3];
+        bool dir_is_neg[3];
+        for (int a = 0; a < 3; a++) {
+            origin[a] = static_cast<float>(r.origin()[a]);
+            inv_dir[a] = 1.0f / static_cast<float>(r.direction()[a]);
+            dir_is_neg[a] = inv_dir[a] < 0;
+        }
+
+        bool hit_anything = false;
+        auto closest_so_far = ray_t.max;
+
+        uint32_t stack[flat_bvh_max_depth];
+        int stack_size = 0;
+        uint32_t current = 0;
+
+        while (true) {
+            const flat_bvh_node& node = nodes[current];
+            if (CountSteps)
+                stats->nodes++;
+            if (node_hit(node, origin, inv_dir, static_cast<float>(ray_t.min), static_cast<float>(closest_so_far))) {
+                if (node.is_leaf()) {
+                    if (CountSteps)
+                        stats->primitives += node.count;
+                    if (sphere_leaves) {
+                        if (leaf_spheres.hit_range(r, interval(ray_t.min, closest_so_far), rec, node.offset, node.count)) {
+                            hit_anything = true;
+                            closest_so_far = rec.t;
+                        }
+                    } else {
+                        for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                            if (primitives[i]->hit(r, interval(ray_t.min, closest_so_far), rec)) {
+                                hit_anything = true;
+                                closest_so_far = rec.t;
+                            }
+                        }
+                    }
+                } else {
+                    // Descend into the child on the near side of the split first, so closest_so_far
+                    // shrinks early and more of the far child gets culled.
+                    if (dir_is_neg[node.axis]) {
+                        stack[stack_size++] = current + 1;
+                        current = node.offset;
+                    } else {
+                        stack[stack_size++] = node.offset;
+                        current = current + 1;
+                    }
+                    continue;
+                }
+            }
+
+            if (stack_size == 0)
+                break;
+            current = stack[--stack_size];
+        }
+
+        return hit_anything;
+    }
+
+    // Index one past the last node of the subtree rooted at `i`: follow second children down to a leaf.
+    uint32_t subtree_end(uint32_t i) const {
+        while (!nodes[i].is_leaf())
+            i = nodes[i].offset;
+        return i + 1;
+    }
+
+    // Cuts the tree into about `wanted` disjoint subtrees by repeatedly expanding the largest one.
+    // The expanded nodes go to `top`, in the order they were expanded.
+    void split_for_refit(size_t wanted, std::vector<uint32_t>& tasks, std::vector<uint32_t>& top) const {
+        tasks.assign(1, 0);
+        while (tasks.size() < wanted) {
+            size_t largest = tasks.size();
+            uint32_t largest_size = 1;
+            for (size_t t = 0; t < tasks.size(); t++) {
+                auto size = subtree_end(tasks[t]) - tasks[t];
+                if (size > largest_size) {
+                    largest = t;
+                    largest_size = size;
+                }
+            }
+            if (largest == tasks.size())
+                break; // Only leaves left.
+
+            auto node_index = tasks[largest];
+            top.push_back(node_index);
+            tasks[largest] = node_index + 1;
+            tasks.push_back(nodes[node_index].offset);
+        }
+    }
+
+    void refit_node(uint32_t i) {
+        auto& node = nodes[i];
+        if (node.is_leaf()) {
+            aabb box;
+            for (uint32_t p = node.offset; p < node.offset + node.count; p++) {
+                box = aabb(box, primitives[p]->bounding_box());
+                if (sphere_leaves)
+                    leaf_spheres.update(p, *static_cast<const sphere*>(primitives[p]));
+            }
+            set_bounds(node, box);
+            return;
+        }
+
+        // Float child bounds are already conservative, so merging them needs no rounding.
+        const auto& first = nodes[i + 1];
+        const auto& second = nodes[node.offset];
+        for (int a = 0; a < 3; a++) {
+            node.bounds_min[a] = first.bounds_min[a] < second.bounds_min[a] ? first.bounds_min[a] : second.bounds_min[a];
+            node.bounds_max[a] = first.bounds_max[a] > second.bounds_max[a] ? first.bounds_max[a] : second.bounds_max[a];
+        }
+    }
+
+    // Float slab test. The exit distance is padded by a few ulps so that rounding in float
+    // never makes a ray miss a box it actually touches.
+    static bool node_hit(const flat_bvh_node& node, const float origin[3], const float inv_dir[3],
+                         float t_min, float t_max) {
+        for (int a = 0; a < 3; a++) {
+            auto t0 = (node.bounds_min[a] - origin[a]) * inv_dir[a];
+            auto t1 = (node.bounds_max[a] - origin[a]) * inv_dir[a];
+            if (t0 > t1)
+                std::swap(t0, t1);
+            t1 *= 1.0000004f;
+
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_min > t_max)
+                return false;
+        }
+        return true;
+    }
+
+    // A piece of the tree under construction: nodes in depth-first order, with child and primitive
+    // offsets relative to this piece. Subtrees built on different threads are spliced together.
+    struct subtree {
+        node_array nodes;
+        std::vector<uint32_t> order; // Source index of each leaf primitive, in leaf order.
+    };
+
+    // SAH cost of testing a leaf's primitives, which come in batches of leaf_batch.
+    double leaf_cost(size_t count) const {
+        return bvh_intersection_cost * ((count + leaf_batch - 1) / leaf_batch);
+    }
+
+    // Largest leaf worth making: a full batch, but no fewer than bvh_max_leaf_size primitives.
+    size_t max_leaf_size() const {
+        return leaf_batch > static_cast<size_t>(bvh_max_leaf_size) ? leaf_batch : static_cast<size_t>(bvh_max_leaf_size);
+    }
+
+    static double node_area(const flat_bvh_node& node) {
+        double dx = node.bounds_max[0] - node.bounds_min[0];
+        double dy = node.bounds_max[1] - node.bounds_min[1];
+        double dz = node.bounds_max[2] - node.bounds_min[2];
+        return 2 * (dx*dy + dy*dz + dz*dx);
+    }
+
+    void build(const std::vector<shared_ptr<hittable>>& src_objects, const bvh_build_options& build_options) {
+        options = build_options;
+        sources = src_objects;
+        nodes.clear();
+        primitives.clear();
+        objects.clear();
+        bbox = aabb();
+        if (src_objects.empty())
+            return;
+        auto num_threads = options.num_threads < 1 ? 1 : options.num_threads;
+        leaf_batch = leaf_batch_for(src_objects);
+
+        std::vector<bvh_primitive> refs(src_objects.size());
+        parallel_chunks(refs.size(), chunks_for(refs.size(), num_threads), [&](int, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                refs[i].bbox = src_objects[i]->bounding_box();
+                refs[i].centroid = refs[i].bbox.centroid();
+                refs[i].index = static_cast<uint32_t>(i);
+            }
+        });
+
+        subtree tree;
+        tree.nodes.reserve(2 * refs.size());
+        tree.order.reserve(refs.size());
+        if (options.builder == bvh_builder::sbvh) {
+            auto budget = static_cast<size_t>(sbvh_max_duplication * refs.size());
+            build_sbvh_node(refs, src_objects, 0, budget, tree);
+        } else if (options.builder == bvh_builder::lbvh && options.morton_bits > 30)
+            build_lbvh<uint64_t>(refs, num_threads, tree);
+        else if (options.builder == bvh_builder::lbvh)
+            build_lbvh<uint32_t>(refs, num_threads, tree);
+        else
+            build_node(refs, 0, refs.size(), 0, num_threads, tree);
+        nodes.swap(tree.nodes);
+        set_leaf_order(src_objects, std::move(tree.order));
+    }
+
+    // Stores the primitives in leaf order and derives everything that depends on the finished nodes.
+    void set_leaf_order(const std::vector<shared_ptr<hittable>>& src_objects, std::vector<uint32_t> leaf_order) {
+        order = std::move(leaf_order);
+        objects.clear();
+        primitives.clear();
+        objects.reserve(order.size());
+        primitives.reserve(order.size());
+        for (auto index : order) {
+            objects.push_back(src_objects[index]);
+            primitives.push_back(objects.back().get());
+        }
+
+        sphere_leaves = !primitives.empty();
+        for (auto primitive : primitives)
+            sphere_leaves = sphere_leaves && dynamic_cast<const sphere*>(primitive) != nullptr;
+        leaf_spheres.clear();
+        if (sphere_leaves)
+            for (auto primitive : primitives)
+                leaf_spheres.add(*static_cast<const sphere*>(primitive));
+
+        built_cost = sah_cost();
+    }
+
+    // Ranges smaller than this are not worth spreading over threads: the cost of starting a thread
+    // exceeds the binning or partitioning work it would take over.
+    static const size_t parallel_grain = 16384;
+
+    static int chunks_for(size_t span, int threads) {
+        auto useful = span / parallel_grain;
+        return useful < 2 ? 1 : static_cast<int>(useful < static_cast<size_t>(threads) ? useful : threads);
+    }
+
+    // Appends the subtree over refs[start, end) to `out` in depth-first order and returns its root index.
+    // Leaf primitives are appended to `out.order` as they are emitted, so they end up contiguous.
+    // With more than one thread, large ranges are binned and partitioned in parallel chunks, and the two
+    // children are built concurrently, each with a share of the threads proportional to its size.
+    uint32_t build_node(std::vector<bvh_primitive>& refs, size_t start, size_t end, int depth, int threads,
+                        subtree& out) {
+        auto node_index = static_cast<uint32_t>(out.nodes.size());
+        out.nodes.push_back(flat_bvh_node());
+
+        auto span = end - start;
+        auto chunks = chunks_for(span, threads);
+
+        aabb bounds, centroid_bounds;
+        if (chunks == 1) {
+            for (size_t i = start; i < end; i++) {
+                bounds = aabb(bounds, refs[i].bbox);
+                centroid_bounds = aabb(centroid_bounds, aabb(refs[i].centroid, refs[i].centroid));
+            }
+        } else {
+            std::vector<aabb> chunk_bounds(chunks), chunk_centroids(chunks);
+            parallel_chunks(span, chunks, [&](int c, size_t begin, size_t finish) {
+                for (size_t i = start + begin; i < start + finish; i++) {
+                    chunk_bounds[c] = aabb(chunk_bounds[c], refs[i].bbox);
+                    chunk_centroids[c] = aabb(chunk_centroids[c], aabb(refs[i].centroid, refs[i].centroid));
+                }
+            });
+            for (int c = 0; c < chunks; c++) {
+                bounds = aabb(bounds, chunk_bounds[c]);
+                centroid_bounds = aabb(centroid_bounds, chunk_centroids[c]);
+            }
+        }
+        if (depth == 0)
+            bbox = bounds;
+        set_bounds(out.nodes[node_index], bounds);
+
+        size_t mid = start + span/2;
+        int axis = centroid_bounds.longest_axis();
+
+        if (depth >= flat_bvh_max_depth - 32) {
+            // Too deep for more SAH splits to be safe: fall back to balanced median splits, which
+            // add at most log2(span) more levels.
+            if (span == 1)
+                return make_leaf(node_index, refs, start, end, out);
+            std::nth_element(refs.begin() + start, refs.begin() + mid, refs.begin() + end,
+                [axis](const bvh_primitive& a, const bvh_primitive& b) {
+                    return a.centroid[axis] < b.centroid[axis];
+                });
+        } else {
+            if (span == 1)
+                return make_leaf(node_index, refs, start, end, out);
+
+            sah_binning binning(centroid_bounds);
+            if (chunks == 1) {
+                for (size_t i = start; i < end; i++)
+                    binning.add(refs[i].bbox, refs[i].centroid);
+            } else {
+                std::vector<sah_binning> chunk_bins(chunks, sah_binning(centroid_bounds));
+                parallel_chunks(span, chunks, [&](int c, size_t begin, size_t finish) {
+                    for (size_t i = start + begin; i < start + finish; i++)
+                        chunk_bins[c].add(refs[i].bbox, refs[i].centroid);
+                });
+                for (const auto& bins : chunk_bins)
+                    binning.merge(bins);
+            }
+
+            int split_bin;
+            auto split_cost = binning.best_split(bounds, axis, split_bin);
+            if (split_cost >= leaf_cost(span) && span <= max_leaf_size())
+                return make_leaf(node_index, refs, start, end, out);
+
+            if (axis < 0) {
+                // All centroids coincide, so split by count.
+                axis = 0;
+            } else {
+                auto goes_left = [&](const bvh_primitive& p) { return binning.bin_index(axis, p.centroid) < split_bin; };
+                if (chunks == 1) {
+                    auto first = refs.begin() + start;
+                    mid = start + (std::partition(first, refs.begin() + end, goes_left) - first);
+                } else {
+                    mid = start + parallel_partition(refs, start, end, chunks, goes_left);
+                }
+            }
+        }
+
+        uint32_t second;
+        if (threads > 1 && span >= parallel_grain) {
+            // Build the children concurrently, then splice them behind this node.
+            auto left_threads = static_cast<int>(0.5 + threads * static_cast<double>(mid - start) / span);
+            left_threads = left_threads < 1 ? 1 : (left_threads > threads - 1 ? threads - 1 : left_threads);
+
+            subtree left, right;
+            std::thread left_builder([&] { build_node(refs, start, mid, depth + 1, left_threads, left); });
+            build_node(refs, mid, end, depth + 1, threads - left_threads, right);
+            left_builder.join();
+
+            append(out, left);
+            second = append(out, right);
+        } else {
+            build_node(refs, start, mid, depth + 1, 1, out);
+            second = build_node(refs, mid, end, depth + 1, 1, out);
+        }
+
+        out.nodes[node_index].offset = second;
+        out.nodes[node_index].count = 0;
+        out.nodes[node_index].axis = static_cast<uint16_t>(axis);
+        return node_index;
+    }
+
+    // Appends the SBVH subtree over `refs`, which it consumes. A spatial split can send a reference to
+    // both children, so every node copies its references into two new vectors instead of partitioning
+    // in place. `budget` is the number of extra references the rest of the build may still create.
+    uint32_t build_sbvh_node(std::vector<bvh_primitive>& refs, const std::vector<shared_ptr<hittable>>& src_objects,
+                             int depth, size_t& budget, subtree& out) {
+        auto node_index = static_cast<uint32_t>(out.nodes.size());
+        out.nodes.push_back(flat_bvh_node());
+
+        aabb bounds, centroid_bounds;
+        for (const auto& ref : refs) {
+            bounds = aabb(bounds, ref.bbox);
+            centroid_bounds = aabb(centroid_bounds, aabb(ref.centroid, ref.centroid));
+        }
+        if (depth == 0) {
+            bbox = bounds;
+            sbvh_root_area = bounds.surface_area();
+        }
+        set_bounds(out.nodes[node_index], bounds);
+
+        auto count = refs.size();
+        if (count == 1)
+            return make_leaf(node_index, refs, 0, 1, out);
+
+        std::vector<bvh_primitive> left, right;
+        int axis = centroid_bounds.longest_axis();
+
+        if (depth >= flat_bvh_max_depth - 32) {
+            // Same fallback as build_node: balanced median splits, without duplication.
+            std::nth_element(refs.begin(), refs.begin() + count/2, refs.end(),
+                [axis](const bvh_primitive& a, const bvh_primitive& b) {
+                    return a.centroid[axis] < b.centroid[axis];
+                });
+            left.assign(refs.begin(), refs.begin() + count/2);
+            right.assign(refs.begin() + count/2, refs.end());
+        } else {
+            sah_binning binning(centroid_bounds);
+            for (const auto& ref : refs)
+                binning.add(ref.bbox, ref.centroid);
+            int object_axis, object_bin;
+            auto object_cost = binning.best_split(bounds, object_axis, object_bin);
+
+            // Spatial splits are only worth binning where the object split leaves its children overlapping.
+            aabb overlap = bounds;
+            if (object_axis >= 0) {
+                aabb object_left, object_right;
+                binning.split_bounds(object_axis, object_bin, object_left, object_right);
+                overlap = object_left.intersect(object_right);
+            }
+
+            int spatial_axis = -1, spatial_bin = 0;
+            auto spatial_cost = infinity;
+            aabb spatial_left, spatial_right;
+            size_t left_count = 0, right_count = 0;
+            spatial_binning spatial(bounds);
+            if (budget > 0 && !overlap.is_empty() && overlap.surface_area() > sbvh_overlap_threshold * sbvh_root_area) {
+                for (const auto& ref : refs)
+                    spatial.add(*src_objects[ref.index], ref.bbox);
+                spatial_cost = spatial.best_split(count, spatial_axis, spatial_bin, spatial_left, spatial_right,
+                                                  left_count, right_count);
+                if (left_count + right_count - count > budget)
+                    spatial_cost = infinity;
+            }
+
+            auto split_cost = spatial_cost < object_cost ? spatial_cost : object_cost;
+            if (split_cost >= leaf_cost(count) && count <= max_leaf_size())
+                return make_leaf(node_index, refs, 0, count, out);
+
+            if (spatial_cost < object_cost) {
+                axis = spatial_axis;
+                auto position = spatial.plane(axis, spatial_bin);
+                for (const auto& ref : refs) {
+                    if (ref.bbox.axis(axis).max <= position) {
+                        left.push_back(ref);
+                    } else if (ref.bbox.axis(axis).min >= position) {
+                        right.push_back(ref);
+                    } else {
+                        // Reference unsplitting: a straddling reference goes to one side only when growing
+                        // that side's box is cheaper than referencing it from both.
+                        auto left_area = spatial_left.surface_area(), right_area = spatial_right.surface_area();
+                        auto split = left_area * left_count + right_area * right_count;
+                        auto only_left = aabb(spatial_left, ref.bbox).surface_area() * left_count
+                                       + right_area * (right_count - 1);
+                        auto only_right = left_area * (left_count - 1)
+                                        + aabb(spatial_right, ref.bbox).surface_area() * right_count;
+                        if (only_left < split && only_left <= only_right) {
+                            left.push_back(ref);
+                            spatial_left = aabb(spatial_left, ref.bbox);
+                            right_count--;
+                        } else if (only_right < split) {
+                            right.push_back(ref);
+                            spatial_right = aabb(spatial_right, ref.bbox);
+                            left_count--;
+                        } else {
+                            bvh_primitive below, above;
+                            split_reference(*src_objects[ref.index], ref, axis, position, below, above);
+                            if (!below.bbox.is_empty())
+                                left.push_back(below);
+                            if (!above.bbox.is_empty())
+                                right.push_back(above);
+                            if (!below.bbox.is_empty() && !above.bbox.is_empty() && budget > 0)
+                                budget--;
+                        }
+                    }
+                }
+            } else if (object_axis >= 0) {
+                axis = object_axis;
+                for (const auto& ref : refs)
+                    (binning.bin_index(axis, ref.centroid) < object_bin ? left : right).push_back(ref);
+            }
+
+            if (left.empty() || right.empty()) {
+                // All centroids coincide, or unsplitting moved everything to one side: split by count.
+                left.assign(refs.begin(), refs.begin() + count/2);
+                right.assign(refs.begin() + count/2, refs.end());
+                if (object_axis < 0)
+                    axis = 0;
+            }
+        }
+
+        // Free this level's references before descending; only one path's worth stays alive.
+        std::vector<bvh_primitive>().swap(refs);
+        build_sbvh_node(left, src_objects, depth + 1, budget, out);
+        auto second = build_sbvh_node(right, src_objects, depth + 1, budget, out);
+
+        out.nodes[node_index].offset = second;
+        out.nodes[node_index].count = 0;
+        out.nodes[node_index].axis = static_cast<uint16_t>(axis);
+        return node_index;
+    }
+
+    // Stable partition of refs[start, end) in parallel chunks: each chunk counts its left-going
+    // primitives, prefix sums give every chunk its output ranges, and the chunks scatter into a copy.
+    // Returns the number of primitives that went left.
+    template <typename Predicate>
+    static size_t parallel_partition(std::vector<bvh_primitive>& refs, size_t start, size_t end, int chunks,
+                                     Predicate goes_left) {
+        auto span = end - start;
+        std::vector<size_t> left_counts(chunks, 0);
+        parallel_chunks(span, chunks, [&](int c, size_t begin, size_t finish) {
+            for (size_t i = start + begin; i < start + finish; i++)
+                if (goes_left(refs[i]))
+                    left_counts[c]++;
+        });
+
+        std::vector<size_t> left_offsets(chunks), right_offsets(chunks);
+        size_t total_left = 0;
+        for (int c = 0; c < chunks; c++) {
+            left_offsets[c] = total_left;
+            total_left += left_counts[c];
+        }
+        for (int c = 0; c < chunks; c++)
+            right_offsets[c] = total_left + (chunk_begin(span, chunks, c) - left_offsets[c]);
+
+        std::vector<bvh_primitive> scattered(span);
+        parallel_chunks(span, chunks, [&](int c, size_t begin, size_t finish) {
+            auto left = left_offsets[c], right = right_offsets[c];
+            for (size_t i = start + begin; i < start + finish; i++) {
+                if (goes_left(refs[i]))
+                    scattered[left++] = refs[i];
+                else
+                    scattered[right++] = refs[i];
+            }
+        });
+        parallel_chunks(span, chunks, [&](int, size_t begin, size_t finish) {
+            std::copy(scattered.begin() + begin, scattered.begin() + finish, refs.begin() + start + begin);
+        });
+
+        return total_left;
+    }
+
+    // Appends `piece` to `out`, rebasing its child and primitive offsets. Returns the new index of its root.
+    static uint32_t append(subtree& out, const subtree& piece) {
+        auto node_base = static_cast<uint32_t>(out.nodes.size());
+        auto prim_base = static_cast<uint32_t>(out.order.size());
+        for (auto node : piece.nodes) {
+            node.offset += node.is_leaf() ? prim_base : node_base;
+            out.nodes.push_back(node);
+        }
+        out.order.insert(out.order.end(), piece.order.begin(), piece.order.end());
+        return node_base;
+    }
+
+    // LBVH build (see lbvh.h): sort the primitives along a Morton curve, derive the radix tree from the
+    // sorted codes and its bounds bottom-up, then lay it out depth-first like the SAH tree.
+    template <typename Key>
+    void build_lbvh(const std::vector<bvh_primitive>& refs, int num_threads, subtree& out) {
+        auto n = refs.size();
+        auto chunks = chunks_for(n, num_threads);
+
+        aabb centroid_bounds;
+        for (const auto& ref : refs) {
+            bbox = aabb(bbox, ref.bbox);
+            centroid_bounds = aabb(centroid_bounds, aabb(ref.centroid, ref.centroid));
+        }
+
+        std::vector<morton_entry<Key>> sorted(n);
+        parallel_chunks(n, chunks, [&](int, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                sorted[i].code = morton_code<Key>(refs[i].centroid, centroid_bounds);
+                sorted[i].index = static_cast<uint32_t>(i);
+            }
+        });
+        parallel_radix_sort(sorted, num_threads);
+
+        std::vector<aabb> leaf_bounds(n);
+        std::vector<uint32_t> leaf_index(n);
+        for (size_t j = 0; j < n; j++) {
+            leaf_bounds[j] = refs[sorted[j].index].bbox;
+            leaf_index[j] = refs[sorted[j].index].index;
+        }
+
+        if (n == 1) {
+            emit_balanced(leaf_bounds, leaf_index, 0, 1, out);
+            return;
+        }
+
+        lbvh_topology topology;
+        build_radix_tree(sorted, num_threads, topology);
+        auto internal_bounds = radix_tree_bounds(topology, leaf_bounds, num_threads);
+        emit_radix_node(topology, internal_bounds, leaf_bounds, leaf_index, 0, 0, out);
+    }
+
+    // Appends radix tree node `child` (an internal node, or a leaf tagged with lbvh_leaf_flag) and its
+    // subtree. Small ranges become leaves, like in the SAH build.
+    uint32_t emit_radix_node(const lbvh_topology& tree, const std::vector<aabb>& internal_bounds,
+                             const std::vector<aabb>& leaf_bounds, const std::vector<uint32_t>& leaf_index,
+                             uint32_t child, int depth, subtree& out) {
+        if (child & lbvh_leaf_flag) {
+            auto position = child & ~lbvh_leaf_flag;
+            return emit_balanced(leaf_bounds, leaf_index, position, position + 1, out);
+        }
+
+        size_t first = tree.first[child], end = tree.last[child] + 1;
+        auto span = end - first;
+        int levels_needed = 0;
+        while ((size_t(1) << levels_needed) < span)
+            levels_needed++;
+
+        // Radix trees over clustered or duplicate codes can get deep. Near the stack limit, lay out the
+        // rest of the range as a balanced tree instead, which is guaranteed to fit.
+        if (span <= static_cast<size_t>(bvh_max_leaf_size) || depth + levels_needed + 1 >= flat_bvh_max_depth)
+            return emit_balanced(leaf_bounds, leaf_index, first, end, out);
+
+        auto node_index = static_cast<uint32_t>(out.nodes.size());
+        out.nodes.push_back(flat_bvh_node());
+        set_bounds(out.nodes[node_index], internal_bounds[child]);
+
+        emit_radix_node(tree, internal_bounds, leaf_bounds, leaf_index, tree.left[child], depth + 1, out);
+        auto second = emit_radix_node(tree, internal_bounds, leaf_bounds, leaf_index, tree.right[child], depth + 1, out);
+
+        out.nodes[node_index].offset = second;
+        out.nodes[node_index].count = 0;
+        out.nodes[node_index].axis = tree.axis[child];
+        return node_index;
+    }
+
+    // Appends a median-split subtree over the sorted leaves [first, end).
+    static uint32_t emit_balanced(const std::vector<aabb>& leaf_bounds, const std::vector<uint32_t>& leaf_index,
+                                  size_t first, size_t end, subtree& out) {
+        auto node_index = static_cast<uint32_t>(out.nodes.size());
+        out.nodes.push_back(flat_bvh_node());
+
+        aabb bounds;
+        for (size_t j = first; j < end; j++)
+            bounds = aabb(bounds, leaf_bounds[j]);
+        set_bounds(out.nodes[node_index], bounds);
+
+        if (end - first <= static_cast<size_t>(bvh_max_leaf_size)) {
+            out.nodes[node_index].offset = static_cast<uint32_t>(out.order.size());
+            out.nodes[node_index].count = static_cast<uint16_t>(end - first);
+            out.order.insert(out.order.end(), leaf_index.begin() + first, leaf_index.begin() + end);
+            return node_index;
+        }
+
+        auto mid = first + (end - first) / 2;
+        emit_balanced(leaf_bounds, leaf_index, first, mid, out);
+        auto second = emit_balanced(leaf_bounds, leaf_index, mid, end, out);
+
+        out.nodes[node_index].offset = second;
+        out.nodes[node_index].count = 0;
+        out.nodes[node_index].axis = static_cast<uint16_t>(bounds.longest_axis());
+        return node_index;
+    }
+
+    static uint32_t make_leaf(uint32_t node_index, const std::vector<bvh_primitive>& refs, size_t start,
+                              size_t end, subtree& out) {
+        out.nodes[node_index].offset = static_cast<uint32_t>(out.order.size());
+        out.nodes[node_index].count = static_cast<uint16_t>(end - start);
+        for (size_t i = start; i < end; i++)
+            out.order.push_back(refs[i].index);
+        return node_index;
+    }
+
+    static void set_bounds(flat_bvh_node& node, const aabb& box) {
+        for (int a = 0; a < 3; a++) {
+            node.bounds_min[a] = round_down_to_float(box.axis(a).min);
+            node.bounds_max[a] = round_up_to_float(box.axis(a).max);
+        }
+    }
+};
+
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "aligned_allocator.h"
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// A width x height array of T, row after row in one cache-line-aligned block.
+// The block is allocated uninitialized, and each row is only written, and so placed in memory, when
+// someone calls fill_rows for it. Renders let each NUMA node's threads fill the rows they render, so
+// the pages of those rows land on that node.
+template <typename T>
+class pixel_plane {
+    static_assert(std::is_trivially_destructible<T>::value, "pixel_plane never destroys its pixels");
+
+  public:
+    pixel_plane() {}
+
+    pixel_plane(int width, int height) : w(width), h(height) {
+        if (size() > 0)
+            data = aligned_allocator<T, cache_line_size>().allocate(size());
+    }
+
+    pixel_plane(pixel_plane&& other) { swap(other); }
+    pixel_plane& operator=(pixel_plane&& other) {
+        swap(other);
+        return *this;
+    }
+    pixel_plane(const pixel_plane&) = delete;
+    pixel_plane& operator=(const pixel_plane&) = delete;
+
+    ~pixel_plane() {
+        if (data)
+            aligned_allocator<T, cache_line_size>().deallocate(data, size());
+    }
+
+    int width() const { return w; }
+    int height() const { return h; }
+    size_t size() const { return static_cast<size_t>(w) * h; }
+
+    // Sets every pixel of rows [first, last) to `value`. Must run for every row before it is read.
+    void fill_rows(int first, int last, const T& value) {
+        for (auto p = row(first); p != row(last); ++p)
+            new (p) T(value);
+    }
+
+    T* row(int j) { return data + static_cast<size_t>(j) * w; }
+    const T* row(int j) const { return data + static_cast<size_t>(j) * w; }
+
+    T& operator()(int i, int j) { return row(j)[i]; }
+    const T& operator()(int i, int j) const { return row(j)[i]; }
+
+  private:
+    int w = 0, h = 0;
+    T* data = nullptr;
+
+    void swap(pixel_plane& other) {
+        std::swap(w, other.w);
+        std::swap(h, other.h);
+        std::swap(data, other.data);
+    }
+};
+
+
+// Linear radiance of a pixel: the mean of its samples, before any gamma or quantization. Alpha is 1
+// once the pixel has samples, and 0 before.
+struct rgba {
+    float r, g, b, a;
+};
+
+// What a render produces; image_output.h encodes it. 16 bytes a pixel, four pixels a cache line.
+typedef pixel_plane<rgba> framebuffer;
+
+
+#endif
@@ -2,6 +2,7 @@
 #define HITTABLE_H
 
 #include "rtweekend.h"
+#include "aabb.h"
 
 class material;
 
@@ -25,6 +26,14 @@ class hittable {
   public:
     virtual ~hittable() = default;
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
+
+    virtual aabb bounding_box() const = 0;
+
+    // Bounds of the part of the object inside `box`, used by spatial-split BVH builds. Objects that can
+    // do better than clamping their bounding box to `box` should, since tighter boxes mean fewer tests.
+    virtual aabb clipped_bounding_box(const aabb& box) const {
+        return bounding_box().intersect(box);
+    }
 };
 
 
@@ -0,0 +1,444 @@
+#ifndef IMAGE_OUTPUT_H
+#define IMAGE_OUTPUT_H
+
+#include "rtweekend.h"
+#include "color.h"
+#include "deflate.h"
+#include "framebuffer.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// The output stage: turns the linear radiance of a framebuffer into display values and encodes them.
+// Rendering never formats pixels itself, so any encoder can run on the same framebuffer.
+
+// Display value in [0, 255] of a linear channel: gamma 2, then clamped and quantized. The framebuffer
+// keeps float means, so a channel whose double mean falls within float precision of a step boundary
+// can come out one step off from the double-precision output of old. That is rare, but P3 files are
+// not byte-identical to theirs in general.
+inline int quantize(float linear) {
+    static const interval intensity(0.000, 0.999);
+    return static_cast<int>(256 * intensity.clamp(linear_to_gamma(linear)));
+}
+
+// Appends the decimal digits of `value`, in [0, 999], to `out`. Returns the end of what it wrote.
+inline char* format_channel(char* out, int value) {
+    if (value >= 100) {
+        *out++ = static_cast<char>('0' + value / 100);
+        value %= 100;
+        *out++ = static_cast<char>('0' + value / 10);
+    } else if (value >= 10) {
+        *out++ = static_cast<char>('0' + value / 10);
+    }
+    *out++ = static_cast<char>('0' + value % 10);
+    return out;
+}
+
+const size_t p3_max_pixel_bytes = 12; // "255 255 255\n"
+
+// Writes the P3 text of rows [first, last) of `image` to `out`, which must have room for
+// p3_max_pixel_bytes per pixel. Returns the end of what it wrote. Nothing is allocated.
+inline char* encode_p3_rows(const framebuffer& image, int first, int last, char* out) {
+    for (int j = first; j < last; j++) {
+        for (auto p = image.row(j); p != image.row(j + 1); ++p) {
+            out = format_channel(out, quantize(p->r));
+            *out++ = ' ';
+            out = format_channel(out, quantize(p->g));
+            *out++ = ' ';
+            out = format_channel(out, quantize(p->b));
+            *out++ = '\n';
+        }
+    }
+    return out;
+}
+
+enum class image_format {
+    p3,  // Plain-text PPM: 8-bit, gamma 2. Readable anywhere, but about 11 bytes a pixel.
+    p6,  // Binary PPM: the same values as P3 in 3 bytes a pixel.
+    pfm, // Portable float map: the linear radiance as 32-bit floats, for HDR tools and compositing.
+    png, // The values of P6, filtered and deflated: lossless, and read by everything.
+    exr  // OpenEXR: the linear radiance as 16-bit floats, ZIP compressed, for HDR tools and compositing.
+};
+
+// The format a file name asks for by its extension (.pfm, .png, .exr, or .ppm for `ppm_format`);
+// `fallback` for others.
+inline image_format image_format_for(const std::string& path, image_format ppm_format, image_format fallback) {
+    auto ends_with = [&](const char* suffix) {
+        auto n = std::strlen(suffix);
+        return path.size() >= n && path.compare(path.size() - n, n, suffix) == 0;
+    };
+    if (ends_with(".pfm"))
+        return image_format::pfm;
+    if (ends_with(".png"))
+        return image_format::png;
+    if (ends_with(".exr"))
+        return image_format::exr;
+    if (ends_with(".ppm"))
+        return ppm_format;
+    return fallback;
+}
+
+// Each encoder builds the whole file, header included, in one buffer, and writes it at once.
+
+// Plain-text (P3) PPM.
+inline void write_ppm(std::ostream& out, const framebuffer& image) {
+    std::string header = "P3\n" + std::to_string(image.width()) + ' ' + std::to_string(image.height()) + "\n255\n";
+    std::vector<char> file(header.size() + image.size() * p3_max_pixel_bytes);
+    std::copy(header.begin(), header.end(), file.begin());
+    auto end = encode_p3_rows(image, 0, image.height(), file.data() + header.size());
+    out.write(file.data(), end - file.data());
+}
+
+// Binary (P6) PPM.
+inline void write_p6(std::ostream& out, const framebuffer& image) {
+    std::string header = "P6\n" + std::to_string(image.width()) + ' ' + std::to_string(image.height()) + "\n255\n";
+    std::vector<char> file(header.size() + image.size() * 3);
+    std::copy(header.begin(), header.end(), file.begin());
+    auto p = file.data() + header.size();
+    for (int j = 0; j < image.height(); j++) {
+        for (auto pixel = image.row(j); pixel != image.row(j + 1); ++pixel) {
+            *p++ = static_cast<char>(quantize(pixel->r));
+            *p++ = static_cast<char>(quantize(pixel->g));
+            *p++ = static_cast<char>(quantize(pixel->b));
+        }
+    }
+    out.write(file.data(), static_cast<std::streamsize>(file.size()));
+}
+
+// Portable float map: three floats a pixel, rows from the bottom up. The sign of the scale in the
+// header gives the byte order, so the floats are written as they are in memory.
+inline void write_pfm(std::ostream& out, const framebuffer& image) {
+    const uint16_t one = 1;
+    const bool little_endian = *reinterpret_cast<const unsigned char*>(&one) == 1;
+    std::string header = "PF\n" + std::to_string(image.width()) + ' ' + std::to_string(image.height())
+                       + (little_endian ? "\n-1.0\n" : "\n1.0\n");
+    std::vector<char> file(header.size() + image.size() * 3 * sizeof(float));
+    std::copy(header.begin(), header.end(), file.begin());
+    auto p = file.data() + header.size();
+    for (int j = image.height(); j-- > 0; ) {
+        for (auto pixel = image.row(j); pixel != image.row(j + 1); ++pixel) {
+            const float rgb[3] = { pixel->r, pixel->g, pixel->b };
+            std::memcpy(p, rgb, sizeof(rgb));
+            p += sizeof(rgb);
+        }
+    }
+    out.write(file.data(), static_cast<std::streamsize>(file.size()));
+}
+
+// Calls job(block, worker) for every block in [0, count): spread over the workers of `pool` when there
+// is one, on this thread as worker 0 otherwise. `worker` is below block_workers(pool), for scratch
+// space kept per thread. The pool must be idle.
+inline void for_each_block(thread_pool* pool, int count, const std::function<void(int, int)>& job) {
+    if (!pool || pool->size() < 2 || count < 2) {
+        for (int b = 0; b < count; b++)
+            job(b, 0);
+        return;
+    }
+    std::atomic<int> next(0);
+    pool->run([&](int worker) {
+        for (int b = next++; b < count; b = next++)
+            job(b, worker);
+    });
+}
+
+inline int block_workers(const thread_pool* pool) { return pool ? pool->size() : 1; }
+
+// PNG: 8-bit RGB, each row filtered by whichever of the five PNG filters leaves the smallest residuals,
+// and deflated in segments of png_segment_rows rows, each segment an IDAT chunk of its own. Segments
+// are filtered, compressed and checksummed in parallel; each restarts the match window, which costs
+// well under 1% in size. The segment size is fixed, so the file does not depend on the thread count.
+const int png_segment_rows = 32;
+
+// Writes `row` filtered by PNG filter `filter` against the row `above` to `out`, and returns the sum of
+// the magnitudes of the filtered bytes, read as signed: the usual guess at how well they will compress.
+inline long png_filter_row(int filter, const unsigned char* row, const unsigned char* above, int bytes,
+                           unsigned char* out) {
+    const int bpp = 3;
+    switch (filter) {
+        case 0:
+            std::copy(row, row + bytes, out);
+            break;
+        case 1: // Sub: the byte to the left
+            for (int x = 0; x < bytes; x++)
+                out[x] = static_cast<unsigned char>(row[x] - (x >= bpp ? row[x - bpp] : 0));
+            break;
+        case 2: // Up: the byte above
+            for (int x = 0; x < bytes; x++)
+                out[x] = static_cast<unsigned char>(row[x] - above[x]);
+            break;
+        case 3: // Average of left and above
+            for (int x = 0; x < bytes; x++)
+                out[x] = static_cast<unsigned char>(row[x] - ((x >= bpp ? row[x - bpp] : 0) + above[x]) / 2);
+            break;
+        default: // Paeth: whichever of left, above and above-left is closest to left + above - above-left
+            for (int x = 0; x < bytes; x++) {
+                int a = x >= bpp ? row[x - bpp] : 0, b = above[x], c = x >= bpp ? above[x - bpp] : 0;
+                int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+                out[x] = static_cast<unsigned char>(row[x] - (pa <= pb && pa <= pc ? a : (pb <= pc ? b : c)));
+            }
+            break;
+    }
+    long cost = 0;
+    for (int x = 0; x < bytes; x++)
+        cost += std::abs(static_cast<int>(static_cast<signed char>(out[x])));
+    return cost;
+}
+
+// Appends the filter byte and filtered bytes of an RGB row, below the row `above`, with whichever of the
+// five filters scores lowest.
+inline void append_png_row(const unsigned char* row, const unsigned char* above, int bytes,
+                           std::vector<unsigned char>& out) {
+    const size_t start = out.size();
+    out.resize(start + 1 + 2 * static_cast<size_t>(bytes)); // The chosen row, then room to try the others.
+    auto best = out.data() + start + 1, trial = best + bytes;
+    long best_cost = png_filter_row(0, row, above, bytes, best);
+    out[start] = 0;
+    for (int filter = 1; filter < 5; filter++) {
+        long cost = png_filter_row(filter, row, above, bytes, trial);
+        if (cost < best_cost) {
+            std::copy(trial, trial + bytes, best);
+            best_cost = cost;
+            out[start] = static_cast<unsigned char>(filter);
+        }
+    }
+    out.resize(start + 1 + bytes);
+}
+
+inline void append_be32(std::vector<unsigned char>& out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<unsigned char>(value >> shift));
+}
+
+// Opens a PNG chunk of type `type` in `out`; append its data, then close it with end_png_chunk.
+inline size_t begin_png_chunk(std::vector<unsigned char>& out, const char* type) {
+    auto start = out.size();
+    append_be32(out, 0);
+    out.insert(out.end(), type, type + 4);
+    return start;
+}
+
+// Fills in the length of the chunk opened at `start` and appends its CRC.
+inline void end_png_chunk(std::vector<unsigned char>& out, size_t start) {
+    auto length = static_cast<uint32_t>(out.size() - start - 8);
+    for (int i = 0; i < 4; i++)
+        out[start + i] = static_cast<unsigned char>(length >> (24 - 8 * i));
+    append_be32(out, crc32(0, out.data() + start + 4, length + 4));
+}
+
+inline void write_png(std::ostream& out, const framebuffer& image, thread_pool* pool = nullptr) {
+    const int width = image.width(), height = image.height(), row_bytes = 3 * width;
+    const int segments = (height + png_segment_rows - 1) / png_segment_rows;
+    std::vector<std::vector<unsigned char>> chunks(segments);
+    std::vector<uint32_t> adlers(segments);
+    std::vector<size_t> filtered_sizes(segments);
+    std::vector<deflate_compressor> compressors(block_workers(pool));
+    std::vector<std::vector<unsigned char>> pixels(block_workers(pool)), filtered(block_workers(pool));
+
+    for_each_block(pool, segments, [&](int s, int worker) {
+        const int first = s * png_segment_rows, last = std::min(height, first + png_segment_rows);
+        // The segment's rows, after the row above it (zeros above the first), which the filters read.
+        auto& rgb = pixels[worker];
+        rgb.assign(static_cast<size_t>(last - first + 1) * row_bytes, 0);
+        for (int j = std::max(first - 1, 0); j < last; j++) {
+            auto p = rgb.data() + static_cast<size_t>(j - first + 1) * row_bytes;
+            for (auto pixel = image.row(j); pixel != image.row(j + 1); ++pixel) {
+                *p++ = static_cast<unsigned char>(quantize(pixel->r));
+                *p++ = static_cast<unsigned char>(quantize(pixel->g));
+                *p++ = static_cast<unsigned char>(quantize(pixel->b));
+            }
+        }
+        auto& data = filtered[worker];
+        data.clear();
+        for (int j = first; j < last; j++) {
+            auto above = rgb.data() + static_cast<size_t>(j - first) * row_bytes;
+            append_png_row(above + row_bytes, above, row_bytes, data);
+        }
+        adlers[s] = adler32(1, data.data(), data.size());
+        filtered_sizes[s] = data.size();
+
+        auto& chunk = chunks[s];
+        auto start = begin_png_chunk(chunk, "IDAT");
+        if (s == 0)
+            append_zlib_header(chunk);
+        compressors[worker].compress(data.data(), data.size(), s == segments - 1, chunk);
+        end_png_chunk(chunk, start);
+    });
+
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    std::vector<unsigned char> file(signature, signature + 8);
+    auto chunk = begin_png_chunk(file, "IHDR");
+    append_be32(file, static_cast<uint32_t>(width));
+    append_be32(file, static_cast<uint32_t>(height));
+    const unsigned char format[5] = { 8, 2, 0, 0, 0 }; // 8 bits, RGB, deflate, adaptive filters, not interlaced
+    file.insert(file.end(), format, format + 5);
+    end_png_chunk(file, chunk);
+
+    uint32_t adler = 1;
+    for (int s = 0; s < segments; s++) {
+        file.insert(file.end(), chunks[s].begin(), chunks[s].end());
+        adler = adler32_combine(adler, adlers[s], filtered_sizes[s]);
+    }
+    chunk = begin_png_chunk(file, "IDAT"); // The zlib stream ends with its checksum.
+    append_zlib_trailer(file, adler);
+    end_png_chunk(file, chunk);
+    end_png_chunk(file, begin_png_chunk(file, "IEND"));
+    out.write(reinterpret_cast<const char*>(file.data()), static_cast<std::streamsize>(file.size()));
+}
+
+// OpenEXR: a single-part scanline file with half-float B, G and R channels under ZIP compression,
+// which deflates blocks of exr_block_lines scanlines independently. The blocks are converted and
+// compressed in parallel; only the header and the copy into the file are left to the calling thread.
+const int exr_block_lines = 16;
+
+// The nearest IEEE half of `value`, rounding ties to even. Too large for a half becomes infinity.
+inline uint16_t float_to_half(float value) {
+    uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+    const auto sign = static_cast<uint16_t>((f >> 16) & 0x8000);
+    const uint32_t magnitude = f & 0x7fffffff;
+    if (magnitude > 0x7f800000)  // NaN
+        return sign | 0x7e00;
+    if (magnitude >= 0x477ff000) // Infinity, or rounds up past 65504
+        return sign | 0x7c00;
+    if (magnitude >= 0x38800000) { // Normal: rebias the exponent, round the mantissa to 10 bits.
+        uint32_t h = magnitude - 0x38000000;
+        h += 0xfff + ((h >> 13) & 1);
+        return static_cast<uint16_t>(sign | (h >> 13));
+    }
+    // Subnormal, in units of 2^-24. Rounding up to 1024 gives the smallest normal, as it should.
+    return static_cast<uint16_t>(sign | static_cast<uint16_t>(std::nearbyint(std::fabs(value) * 16777216.0f)));
+}
+
+inline void append_le32(std::vector<unsigned char>& out, uint32_t value) {
+    for (int shift = 0; shift < 32; shift += 8)
+        out.push_back(static_cast<unsigned char>(value >> shift));
+}
+
+inline void write_exr(std::ostream& out, const framebuffer& image, thread_pool* pool = nullptr) {
+    const int width = image.width(), height = image.height();
+    const int blocks = (height + exr_block_lines - 1) / exr_block_lines;
+    float rgba::* const channels[3] = { &rgba::b, &rgba::g, &rgba::r }; // EXR sorts channels by name.
+    std::vector<std::vector<unsigned char>> chunks(blocks);
+    std::vector<deflate_compressor> compressors(block_workers(pool));
+    std::vector<std::vector<unsigned char>> raws(block_workers(pool)), predicted(block_workers(pool));
+
+    for_each_block(pool, blocks, [&](int b, int worker) {
+        const int first = b * exr_block_lines, last = std::min(height, first + exr_block_lines);
+        // Each scanline holds all of its B values, then G, then R, as little-endian halves.
+        auto& raw = raws[worker];
+        raw.resize(static_cast<size_t>(last - first) * width * 3 * sizeof(uint16_t));
+        auto p = raw.data();
+        for (int j = first; j < last; j++) {
+            for (auto channel : channels) {
+                for (auto pixel = image.row(j); pixel != image.row(j + 1); ++pixel) {
+                    auto h = float_to_half(pixel->*channel);
+                    *p++ = static_cast<unsigned char>(h);
+                    *p++ = static_cast<unsigned char>(h >> 8);
+                }
+            }
+        }
+
+        // ZIP compression deflates the bytes reordered low bytes first, then high bytes, and stored as
+        // differences from the byte before, which makes smooth images mostly small numbers.
+        auto& deltas = predicted[worker];
+        const size_t size = raw.size(), half = (size + 1) / 2;
+        deltas.resize(size);
+        for (size_t k = 0; k < size; k++)
+            deltas[(k & 1) ? half + k / 2 : k / 2] = raw[k];
+        for (size_t k = size; k-- > 1; )
+            deltas[k] = static_cast<unsigned char>(deltas[k] - deltas[k - 1] + 128);
+
+        auto& chunk = chunks[b];
+        append_le32(chunk, static_cast<uint32_t>(first));
+        append_le32(chunk, 0);
+        zlib_compress(compressors[worker], deltas.data(), size, chunk);
+        if (chunk.size() - 8 >= size) { // Readers take a block that did not shrink as it is.
+            chunk.resize(8);
+            chunk.insert(chunk.end(), raw.begin(), raw.end());
+        }
+        auto packed = static_cast<uint32_t>(chunk.size() - 8);
+        for (int i = 0; i < 4; i++)
+            chunk[4 + i] = static_cast<unsigned char>(packed >> (8 * i));
+    });
+
+    static const unsigned char magic[8] = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 }; // Version 2, single-part scanline
+    std::vector<unsigned char> file(magic, magic + 8);
+    auto attribute = [&file](const char* name, const char* type, const std::vector<unsigned char>& value) {
+        file.insert(file.end(), name, name + std::strlen(name) + 1);
+        file.insert(file.end(), type, type + std::strlen(type) + 1);
+        append_le32(file, static_cast<uint32_t>(value.size()));
+        file.insert(file.end(), value.begin(), value.end());
+    };
+    auto le32s = [](std::initializer_list<uint32_t> values) {
+        std::vector<unsigned char> bytes;
+        for (auto v : values)
+            append_le32(bytes, v);
+        return bytes;
+    };
+    uint32_t one;
+    const float unit = 1.0f;
+    std::memcpy(&one, &unit, sizeof(one));
+
+    std::vector<unsigned char> channel_list;
+    for (const char* name : { "B", "G", "R" }) {
+        channel_list.push_back(static_cast<unsigned char>(name[0]));
+        channel_list.push_back(0);
+        auto description = le32s({ 1, 0, 1, 1 }); // Half; not perceptually linear; no subsampling
+        channel_list.insert(channel_list.end(), description.begin(), description.end());
+    }
+    channel_list.push_back(0);
+    const auto window = le32s({ 0, 0, static_cast<uint32_t>(width - 1), static_cast<uint32_t>(height - 1) });
+    attribute("channels", "chlist", channel_list);
+    attribute("compression", "compression", std::vector<unsigned char>(1, 3)); // ZIP, 16 scanlines a block
+    attribute("dataWindow", "box2i", window);
+    attribute("displayWindow", "box2i", window);
+    attribute("lineOrder", "lineOrder", std::vector<unsigned char>(1, 0)); // Increasing y
+    attribute("pixelAspectRatio", "float", le32s({ one }));
+    attribute("screenWindowCenter", "v2f", le32s({ 0, 0 }));
+    attribute("screenWindowWidth", "float", le32s({ one }));
+    file.push_back(0); // End of the header.
+
+    // The offset table: where each block starts in the file.
+    uint64_t offset = file.size() + 8 * static_cast<uint64_t>(blocks);
+    for (const auto& chunk : chunks) {
+        append_le32(file, static_cast<uint32_t>(offset));
+        append_le32(file, static_cast<uint32_t>(offset >> 32));
+        offset += chunk.size();
+    }
+    for (const auto& chunk : chunks)
+        file.insert(file.end(), chunk.begin(), chunk.end());
+    out.write(reinterpret_cast<const char*>(file.data()), static_cast<std::streamsize>(file.size()));
+}
+
+// Writes `image` in `format`. PNG and EXR compress on the workers of `pool`, when given; it must be idle.
+inline void write_image(std::ostream& out, const framebuffer& image, image_format format, thread_pool* pool = nullptr) {
+    switch (format) {
+        case image_format::p6:  write_p6(out, image); break;
+        case image_format::pfm: write_pfm(out, image); break;
+        case image_format::png: write_png(out, image, pool); break;
+        case image_format::exr: write_exr(out, image, pool); break;
+        default:                write_ppm(out, image); break;
+    }
+}
+
+// Writes `image` to the file at `path`, replacing it. Returns false if that failed.
+inline bool write_image_file(const std::string& path, const framebuffer& image, image_format format,
+                             thread_pool* pool = nullptr) {
+    std::ofstream out(path, std::ios::binary);
+    write_image(out, image, format, pool);
+    return static_cast<bool>(out);
+}
+
+#endif
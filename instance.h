@@ -0,0 +1,154 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "rtweekend.h"
+#include "hittable.h"
+
+// Two-level acceleration: a bottom-level structure (BLAS) is built once per unique piece of geometry,
+// and every copy in the scene is an `instance` that points at it with its own transform. The scene's
+// own BVH (the top level, TLAS) is then built over the instances, like over any other hittable. Memory
+// scales with the unique geometry, not with the number of copies.
+
+// Affine transform: a 3x3 linear part (rotation, scale, shear) followed by a translation, stored as the
+// top three rows of a 4x4 matrix.
+class affine_transform {
+  public:
+    affine_transform() {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                m[i][j] = (i == j) ? 1 : 0;
+    }
+
+    static affine_transform translation(const vec3& offset) {
+        affine_transform t;
+        for (int i = 0; i < 3; i++)
+            t.m[i][3] = offset[i];
+        return t;
+    }
+
+    // Rotation about the y axis, counterclockwise when looking down from +y.
+    static affine_transform rotation_y(double degrees) {
+        auto radians = degrees_to_radians(degrees);
+        affine_transform t;
+        t.m[0][0] =  cos(radians); t.m[0][2] = sin(radians);
+        t.m[2][0] = -sin(radians); t.m[2][2] = cos(radians);
+        return t;
+    }
+
+    static affine_transform scaling(double factor) {
+        affine_transform t;
+        for (int i = 0; i < 3; i++)
+            t.m[i][i] = factor;
+        return t;
+    }
+
+    // Composition: (a * b) applies b first, then a.
+    affine_transform operator*(const affine_transform& b) const {
+        affine_transform t;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                t.m[i][j] = m[i][0]*b.m[0][j] + m[i][1]*b.m[1][j] + m[i][2]*b.m[2][j];
+                if (j == 3)
+                    t.m[i][j] += m[i][3];
+            }
+        }
+        return t;
+    }
+
+    point3 apply_point(const point3& p) const {
+        return point3(m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3],
+                      m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3],
+                      m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3]);
+    }
+
+    vec3 apply_vector(const vec3& v) const {
+        return vec3(m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2],
+                    m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2],
+                    m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2]);
+    }
+
+    // Multiplies by the transpose of the linear part. Applied on the inverse transform, this maps
+    // normals, which must stay perpendicular to surfaces under non-uniform scaling.
+    vec3 apply_transposed(const vec3& v) const {
+        return vec3(m[0][0]*v[0] + m[1][0]*v[1] + m[2][0]*v[2],
+                    m[0][1]*v[0] + m[1][1]*v[1] + m[2][1]*v[2],
+                    m[0][2]*v[0] + m[1][2]*v[1] + m[2][2]*v[2]);
+    }
+
+    // Inverse via the adjugate of the linear part. The transform must not be singular.
+    affine_transform inverse() const {
+        affine_transform t;
+        auto det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+                 - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+                 + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+        auto inv_det = 1 / det;
+
+        t.m[0][0] =  (m[1][1]*m[2][2] - m[1][2]*m[2][1]) * inv_det;
+        t.m[0][1] = -(m[0][1]*m[2][2] - m[0][2]*m[2][1]) * inv_det;
+        t.m[0][2] =  (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * inv_det;
+        t.m[1][0] = -(m[1][0]*m[2][2] - m[1][2]*m[2][0]) * inv_det;
+        t.m[1][1] =  (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * inv_det;
+        t.m[1][2] = -(m[0][0]*m[1][2] - m[0][2]*m[1][0]) * inv_det;
+        t.m[2][0] =  (m[1][0]*m[2][1] - m[1][1]*m[2][0]) * inv_det;
+        t.m[2][1] = -(m[0][0]*m[2][1] - m[0][1]*m[2][0]) * inv_det;
+        t.m[2][2] =  (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * inv_det;
+
+        // The inverse translation undoes the original one: -L^-1 * offset.
+        auto offset = t.apply_vector(vec3(m[0][3], m[1][3], m[2][3]));
+        for (int i = 0; i < 3; i++)
+            t.m[i][3] = -offset[i];
+        return t;
+    }
+
+  private:
+    double m[3][4];
+};
+
+
+// A transformed reference to shared geometry, usually a BVH over the geometry's primitives.
+// Rays are moved into the object's space instead of moving the object: the direction is transformed
+// without normalizing it, so hit distances t are the same in both spaces and need no conversion.
+class instance : public hittable {
+  public:
+    instance(shared_ptr<hittable> object, const affine_transform& object_to_world)
+      : object(object), to_world(object_to_world), to_object(object_to_world.inverse()) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        ray local(to_object.apply_point(r.origin()), to_object.apply_vector(r.direction()));
+        if (!object->hit(local, ray_t, rec))
+            return false;
+
+        // front_face was decided in object space, and the inverse transpose keeps the normal's side.
+        rec.p = r.at(rec.t);
+        rec.normal = unit_vector(to_object.apply_transposed(rec.normal));
+        return true;
+    }
+
+    // Box around the eight transformed corners of the object's box. It is recomputed on every call,
+    // so it stays right when the shared geometry is refit; only BVH builds and refits call it.
+    aabb bounding_box() const override {
+        auto box = object->bounding_box();
+        if (box.is_empty())
+            return box;
+
+        aabb world_box;
+        for (int corner = 0; corner < 8; corner++) {
+            point3 p((corner & 1) ? box.x.max : box.x.min,
+                     (corner & 2) ? box.y.max : box.y.min,
+                     (corner & 4) ? box.z.max : box.z.min);
+            auto q = to_world.apply_point(p);
+            world_box = aabb(world_box, aabb(q, q));
+        }
+        return world_box;
+    }
+
+    const shared_ptr<hittable>& geometry() const { return object; }
+
+  private:
+    shared_ptr<hittable> object;
+    affine_transform to_world;
+    affine_transform to_object;
+};
+
+
+#endif
@@ -9,6 +9,9 @@ class interval {
 
     interval(double _min, double _max) : min(_min), max(_max) {}
 
+    interval(const interval& a, const interval& b) // Smallest interval enclosing both a and b
+      : min(a.min <= b.min ? a.min : b.min), max(a.max >= b.max ? a.max : b.max) {}
+
     double size() const {
         return max - min;
     }
@@ -0,0 +1,258 @@
+#ifndef LBVH_H
+#define LBVH_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Linear BVH (LBVH) construction.
+// Primitives are ordered along a Morton (Z-order) curve through their centroids, which places primitives
+// that are close in space close in the array. The hierarchy then falls out of the sorted codes: every
+// internal node splits its range where the codes' highest differing bit changes (Karras 2012,
+// "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees"). Every step is linear
+// and runs in parallel, so builds are much faster than SAH builds, at the cost of tree quality.
+
+// Spreads the low 10 bits of v out to every third bit, for 30-bit codes with 10 bits per axis.
+inline uint32_t morton_expand_bits(uint32_t v) {
+    v &= 0x3ffu;
+    v = (v | (v << 16)) & 0x030000ffu;
+    v = (v | (v <<  8)) & 0x0300f00fu;
+    v = (v | (v <<  4)) & 0x030c30c3u;
+    v = (v | (v <<  2)) & 0x09249249u;
+    return v;
+}
+
+// Spreads the low 21 bits of v out to every third bit, for 63-bit codes with 21 bits per axis.
+inline uint64_t morton_expand_bits(uint64_t v) {
+    v &= 0x1fffffull;
+    v = (v | (v << 32)) & 0x001f00000000ffffull;
+    v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+    v = (v | (v <<  8)) & 0x100f00f00f00f00full;
+    v = (v | (v <<  4)) & 0x10c30c30c30c30c3ull;
+    v = (v | (v <<  2)) & 0x1249249249249249ull;
+    return v;
+}
+
+// Morton code of point p inside `bounds`, interleaving x, y and z bits (x highest).
+// Key is uint32_t for 30-bit codes or uint64_t for 63-bit codes.
+template <typename Key>
+Key morton_code(const point3& p, const aabb& bounds) {
+    const int bits_per_axis = sizeof(Key) == 4 ? 10 : 21;
+    const double cells = static_cast<double>(1u << bits_per_axis);
+
+    Key code = 0;
+    for (int a = 0; a < 3; a++) {
+        auto extent = bounds.axis(a).size();
+        auto t = extent > 0 ? (p[a] - bounds.axis(a).min) / extent : 0.0;
+        auto cell = t * cells;
+        cell = cell < 0 ? 0 : (cell > cells - 1 ? cells - 1 : cell);
+        code |= morton_expand_bits(static_cast<Key>(cell)) << (2 - a);
+    }
+    return code;
+}
+
+inline int count_leading_zeros(uint32_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return x == 0 ? 32 : __builtin_clz(x);
+#else
+    int n = 0;
+    for (uint32_t bit = 0x80000000u; bit != 0 && !(x & bit); bit >>= 1) n++;
+    return n;
+#endif
+}
+
+inline int count_leading_zeros(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return x == 0 ? 64 : __builtin_clzll(x);
+#else
+    uint32_t high = static_cast<uint32_t>(x >> 32);
+    return high != 0 ? count_leading_zeros(high) : 32 + count_leading_zeros(static_cast<uint32_t>(x));
+#endif
+}
+
+// A Morton code and the primitive it belongs to.
+template <typename Key>
+struct morton_entry {
+    Key      code;
+    uint32_t index;
+};
+
+// Sorts entries by code with a least-significant-digit radix sort, 8 bits per pass.
+// Each pass counts digits per chunk in parallel, prefix-sums the (digit, chunk) histogram so every chunk
+// knows where its entries go, and scatters in parallel. Passes where every code shares the digit are skipped.
+template <typename Key>
+void parallel_radix_sort(std::vector<morton_entry<Key>>& entries, int num_threads) {
+    const int radix = 256;
+    auto n = entries.size();
+    auto chunks = static_cast<int>(n / 16384);
+    chunks = chunks < 1 ? 1 : (chunks > num_threads ? num_threads : chunks);
+
+    std::vector<morton_entry<Key>> buffer(n);
+    std::vector<size_t> histogram(static_cast<size_t>(chunks) * radix);
+
+    for (int shift = 0; shift < static_cast<int>(8 * sizeof(Key)); shift += 8) {
+        std::fill(histogram.begin(), histogram.end(), 0);
+        parallel_chunks(n, chunks, [&](int c, size_t begin, size_t end) {
+            auto counts = &histogram[static_cast<size_t>(c) * radix];
+            for (size_t i = begin; i < end; i++)
+                counts[(entries[i].code >> shift) & (radix - 1)]++;
+        });
+
+        // Turn counts into output offsets, digit-major so the sort stays stable.
+        bool skip = false;
+        size_t offset = 0;
+        for (int d = 0; d < radix; d++) {
+            size_t digit_total = 0;
+            for (int c = 0; c < chunks; c++) {
+                auto& slot = histogram[static_cast<size_t>(c) * radix + d];
+                auto count = slot;
+                slot = offset;
+                offset += count;
+                digit_total += count;
+            }
+            if (digit_total == n)
+                skip = true;
+        }
+        if (skip)
+            continue;
+
+        parallel_chunks(n, chunks, [&](int c, size_t begin, size_t end) {
+            auto offsets = &histogram[static_cast<size_t>(c) * radix];
+            for (size_t i = begin; i < end; i++)
+                buffer[offsets[(entries[i].code >> shift) & (radix - 1)]++] = entries[i];
+        });
+        entries.swap(buffer);
+    }
+}
+
+// Leaves are referenced by their position in the sorted order, tagged with this bit.
+const uint32_t lbvh_leaf_flag = 0x80000000u;
+
+// Binary radix tree over n sorted codes: n - 1 internal nodes, with internal node 0 as the root.
+struct lbvh_topology {
+    std::vector<uint32_t> left, right;  // Children: an internal node index, or a leaf position | lbvh_leaf_flag.
+    std::vector<uint32_t> first, last;  // Range of sorted leaves below each internal node.
+    std::vector<uint8_t>  axis;         // Axis of the Morton bit that splits the node.
+    std::vector<uint32_t> parent;       // Parent of internal node i at [i], of leaf j at [n - 1 + j].
+};
+
+// Builds the radix tree. Every internal node is computed independently of the others (Karras 2012,
+// section 4): find which direction its range extends in, binary-search the range's other end, then
+// binary-search the split position, where the common prefix of the codes gets shorter.
+template <typename Key>
+void build_radix_tree(const std::vector<morton_entry<Key>>& sorted, int num_threads, lbvh_topology& tree) {
+    auto n = static_cast<int64_t>(sorted.size());
+    const int key_bits = 8 * sizeof(Key);
+    const int unused_bits = sizeof(Key) == 4 ? 2 : 1; // 30- and 63-bit codes leave the top bits clear.
+
+    // Length of the common prefix of codes i and j; -1 outside the array. Duplicate codes are told apart
+    // by their positions, as if the position were appended to the code.
+    auto delta = [&](int64_t i, int64_t j) -> int {
+        if (j < 0 || j >= n)
+            return -1;
+        auto a = sorted[i].code, b = sorted[j].code;
+        if (a != b)
+            return count_leading_zeros(static_cast<Key>(a ^ b));
+        return key_bits + count_leading_zeros(static_cast<uint32_t>(i ^ j));
+    };
+
+    auto internal_count = static_cast<size_t>(n - 1);
+    tree.left.assign(internal_count, 0);
+    tree.right.assign(internal_count, 0);
+    tree.first.assign(internal_count, 0);
+    tree.last.assign(internal_count, 0);
+    tree.axis.assign(internal_count, 0);
+    tree.parent.assign(internal_count + static_cast<size_t>(n), 0);
+
+    auto chunks = static_cast<int>(internal_count / 4096);
+    chunks = chunks < 1 ? 1 : (chunks > num_threads ? num_threads : chunks);
+    parallel_chunks(internal_count, chunks, [&](int, size_t begin, size_t end) {
+        for (auto node = static_cast<int64_t>(begin); node < static_cast<int64_t>(end); node++) {
+            auto i = node;
+            int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+
+            // Upper bound for the length of the range, then its exact other end j.
+            auto delta_min = delta(i, i - d);
+            int64_t l_max = 2;
+            while (delta(i, i + l_max * d) > delta_min)
+                l_max *= 2;
+            int64_t l = 0;
+            for (auto t = l_max / 2; t >= 1; t /= 2)
+                if (delta(i, i + (l + t) * d) > delta_min)
+                    l += t;
+            auto j = i + l * d;
+
+            // Split position: the last index that still shares more than delta_node bits with i.
+            auto delta_node = delta(i, j);
+            int64_t s = 0;
+            for (int64_t div = 2; ; div *= 2) {
+                auto t = (l + div - 1) / div;
+                if (delta(i, i + (s + t) * d) > delta_node)
+                    s += t;
+                if (t <= 1)
+                    break;
+            }
+            auto gamma = i + s * d + (d < 0 ? -1 : 0);
+
+            auto lo = i < j ? i : j, hi = i < j ? j : i;
+            auto left = static_cast<uint32_t>(gamma);
+            auto right = static_cast<uint32_t>(gamma + 1);
+            tree.left[node] = lo == gamma ? (left | lbvh_leaf_flag) : left;
+            tree.right[node] = hi == gamma + 1 ? (right | lbvh_leaf_flag) : right;
+            tree.first[node] = static_cast<uint32_t>(lo);
+            tree.last[node] = static_cast<uint32_t>(hi);
+
+            // The first differing bit below the common prefix decides the axis: bits cycle x, y, z from
+            // the top. Nodes that only split duplicate codes get axis 0.
+            auto bit = delta_node - unused_bits;
+            tree.axis[node] = static_cast<uint8_t>(delta_node < key_bits ? bit % 3 : 0);
+
+            tree.parent[tree.left[node] & lbvh_leaf_flag ? internal_count + left : left] = static_cast<uint32_t>(node);
+            tree.parent[tree.right[node] & lbvh_leaf_flag ? internal_count + right : right] = static_cast<uint32_t>(node);
+        }
+    });
+}
+
+// Bounds of every internal node, computed bottom-up in parallel: a thread starts at each leaf and walks
+// towards the root; at each node the first thread to arrive stops, and the second (which knows both
+// children are done) merges their bounds and continues upwards.
+inline std::vector<aabb> radix_tree_bounds(const lbvh_topology& tree, const std::vector<aabb>& leaf_bounds,
+                                           int num_threads) {
+    auto n = leaf_bounds.size();
+    auto internal_count = n - 1;
+    std::vector<aabb> bounds(internal_count);
+    std::unique_ptr<std::atomic<int>[]> visits(new std::atomic<int>[internal_count]);
+    for (size_t i = 0; i < internal_count; i++)
+        visits[i].store(0, std::memory_order_relaxed);
+
+    auto child_bounds = [&](uint32_t child) -> const aabb& {
+        return (child & lbvh_leaf_flag) ? leaf_bounds[child & ~lbvh_leaf_flag] : bounds[child];
+    };
+
+    auto chunks = static_cast<int>(n / 4096);
+    chunks = chunks < 1 ? 1 : (chunks > num_threads ? num_threads : chunks);
+    parallel_chunks(n, chunks, [&](int, size_t begin, size_t end) {
+        for (size_t leaf = begin; leaf < end; leaf++) {
+            auto node = tree.parent[internal_count + leaf];
+            while (true) {
+                if (visits[node].fetch_add(1, std::memory_order_acq_rel) == 0)
+                    break; // The sibling subtree is not finished; its thread will carry on from here.
+                bounds[node] = aabb(child_bounds(tree.left[node]), child_bounds(tree.right[node]));
+                if (node == 0)
+                    break;
+                node = tree.parent[node];
+            }
+        }
+    });
+
+    return bounds;
+}
+
+
+#endif
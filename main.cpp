@@ -1,37 +1,84 @@
 // Include necessary files to build the raytracer! 
 
 #include "rtweekend.h"
+#include "bvh.h"
+#include "benchmarks.h"
+#include "bvh_cache.h"
 #include "camera.h"
 #include "color.h"
+#include "flat_bvh.h"
 #include "hittable_list.h"
+#include "instance.h"
 #include "material.h"
+#include "options.h"
 #include "sphere.h"
+#include "wide_bvh.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
 
-int main() {
 
-    // Function to generate a random seed using the current time.
-    // Without this, every time you run the program, you will get the same image.
+// File name of animation frame `frame` when writing to `path`: "out.ppm" becomes "out-0001.ppm".
+static std::string frame_path(const std::string& path, int frame) {
+    auto dot = path.find_last_of('.');
+    auto slash = path.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = path.size();
+    auto number = std::to_string(frame + 1);
+    return path.substr(0, dot) + "-" + std::string(number.size() < 4 ? 4 - number.size() : 0, '0') + number + path.substr(dot);
+}
 
-    seed_random();  
-    
-    // Creates an instance of the hittable_list, which will store all objects in the scene.
-    hittable_list world;
+int main(int argc, char* argv[]) {
 
-    // Our ground is represented as a very large lambertian sphere with a radius of 2500.
-    // It is colored gray (Can be recolored!) and whose center is at (0,-2500,0).
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0,-2500,0), 2500, ground_material));
+    // Read the command-line options. Without any, we render the stock scene.
+    render_options opts;
+    if (!parse_options(argc, argv, opts))
+        return 1;
+    if (opts.simd == "scalar")
+        simd_level_cap() = simd_level::scalar;
+
+    // Generate a random seed using the current time, so every run renders a different scene.
+    // --seed fixes it instead, which --bvh-cache needs to find the same scene again. The seed also
+    // keys the camera's random numbers, so the same seed renders the same image, bit for bit,
+    // whatever the thread count; it is printed so any run can be repeated.
+    const uint64_t seed = opts.seed > 0 ? static_cast<uint64_t>(opts.seed) : static_cast<uint64_t>(time(NULL));
+    seed_random(seed);
+    std::clog << "Seed: " << seed << "\n";
+
+    // --bench rng, warps and encode need no scene.
+    if (opts.bench == "rng") {
+        bench_rng(opts.threads > 0 ? opts.threads : hardware_thread_count());
+        return 0;
+    }
+    if (opts.bench == "warps") {
+        bench_warps();
+        return 0;
+    }
+    if (opts.bench == "encode") {
+        bench_encode(opts.image_width, static_cast<int>(opts.image_width * 9.0 / 16.0));
+        return 0;
+    }
+    
+    // The small spheres go into their own list, which is either added to the scene directly or,
+    // with --instances, shared by every copy of the grid.
+    hittable_list tile;
 
     // Here, we're generating a bunch of random spheres to populate the scene.
     // The outer loop a is for the x-axis, and inner loop b is for the z-axis.
+    // The grid spans [-grid, grid) on both axes, so it holds about (2*grid)^2 = opts.spheres spheres.
     // The spheres are placed in a grid pattern, with a random offset on both x,z of up to 0.9 units.
     // The y-axis center of each sphere is 0.2 units above the ground to match their radius of 0.2.
     // The spheres are colored randomly, with a 80% chance of being a diffuse sphere, and 
     // 15% chance of being a metal sphere, and 5% chance of being a glass sphere.
 
-    for (int a = -40; a < 40; a++) {
-        for (int b = -40; b < 40; b++) {
+    std::vector<shared_ptr<sphere>> small_spheres;
+    std::vector<point3> start_centers;
+    const int grid = std::max(1, static_cast<int>(std::lround(std::sqrt(opts.spheres) / 2)));
+    for (int a = -grid; a < grid; a++) {
+        for (int b = -grid; b < grid; b++) {
             auto choose_mat = random_double(); //Generate a double from 0-1
             point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double()); // Generate a random sphere-center offset by a random double
 
@@ -46,35 +93,73 @@ int main() {
                     // will always result in a lower value! This is more visually pleasng. Too bright of colors are not.
                     auto albedo = color::random() * color::random(); 
                     sphere_material = make_shared<lambertian>(albedo); // Create a lambertian material with the random color.
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material)); // Add the sphere to the world.
                 } else if (choose_mat < 0.95) {// 15% chance of being a metal sphere.
                     auto albedo = color::random(0.5, 1); // Random color between 0.5 and 1.
                     auto fuzz = random_double(0, 0.5); // Random fuzziness between 0 and 0.5
                     sphere_material = make_shared<metal>(albedo, fuzz); // Create a metal material with the random color.
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material)); // Add the sphere to the world.
                 } else { // 5% chance of being a glass sphere.
                     sphere_material = make_shared<dielectric>(1.5); // Create a glass material.
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material)); // Add the sphere to the world.
                 }
+
+                auto small_sphere = make_shared<sphere>(center, 0.2, sphere_material);
+                tile.add(small_sphere); // Add the sphere to the grid.
+                small_spheres.push_back(small_sphere); // Remember it and where it started, so --frames can animate it.
+                start_centers.push_back(center);
             }
         }
     }
 
-    // Add large sphere made of glass at the left-center of the scene
+    // Our ground is represented as a very large lambertian sphere with a radius of 2500.
+    // It is colored gray (Can be recolored!) and whose center is at (0,-2500,0).
+    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    auto ground = make_shared<sphere>(point3(0,-2500,0), 2500, ground_material);
+
+    // Large sphere made of glass at the left-center of the scene
     auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material1));
+    auto glass_sphere = make_shared<sphere>(point3(-4, 1, 0), 1.0, material1);
 
-    // Add large sphere made of metal at the right-center of the scene
+    // Large sphere made of metal at the right-center of the scene
     auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    auto metal_sphere = make_shared<sphere>(point3(4, 1, 0), 1.0, material3);
+
+    // With --instances N, copy 0 of the grid sits where the grid always does and the others surround
+    // it in rings, each turned and scaled at random. A uniform scale about the origin keeps the spheres
+    // resting on the ground.
+    std::vector<affine_transform> placements;
+    const double tile_span = 2 * grid + 1;
+    for (int ring = 0; static_cast<int>(placements.size()) < opts.instances; ring++) {
+        for (int i = -ring; i <= ring && static_cast<int>(placements.size()) < opts.instances; i++) {
+            for (int j = -ring; j <= ring && static_cast<int>(placements.size()) < opts.instances; j++) {
+                if (std::max(std::abs(i), std::abs(j)) != ring)
+                    continue;
+                if (ring == 0) {
+                    placements.push_back(affine_transform());
+                    continue;
+                }
+                placements.push_back(affine_transform::translation(vec3(i * tile_span, 0, j * tile_span))
+                                   * affine_transform::rotation_y(random_double(0, 360))
+                                   * affine_transform::scaling(random_double(0.7, 1.3)));
+            }
+        }
+    }
+
+    // Build the scene with as many threads as the renderer will use.
+    const int num_threads = opts.threads > 0 ? opts.threads : hardware_thread_count();
 
     // Initialize cam
     camera cam;
 
     cam.aspect_ratio      = 16.0 / 9.0; //Defines the dimensions of our image.
-    cam.image_width       = 1600; // Width of the image in pixels.
-    cam.samples_per_pixel = 500; // Number of samples to take per pixel - rays per pixel.
-    cam.max_depth         = 50; // Maximum number of bounces for a ray.
+    cam.image_width       = opts.image_width; // Width of the image in pixels.
+    cam.samples_per_pixel = opts.samples_per_pixel; // Number of samples to take per pixel - rays per pixel.
+    cam.max_depth         = opts.max_depth; // Maximum number of bounces for a ray.
+    cam.roulette_depth    = opts.roulette_depth; // Bounces before Russian roulette may end a path.
+    cam.adaptive_error        = opts.adaptive; // Spend the samples where the image is still noisy.
+    cam.max_samples_per_pixel = opts.max_spp;
+    cam.progressive_samples   = opts.progressive; // Passes of a few samples, snapshots and a time limit.
+    cam.time_limit            = opts.time_limit;
+    cam.snapshot_path         = opts.snapshot;
+    cam.snapshot_interval     = opts.snapshot_interval;
 
     cam.vfov     = 40; // Vertical field-of-view in degrees.
     cam.lookfrom = point3(13,2,3); // Camera origin.
@@ -84,6 +169,185 @@ int main() {
     cam.defocus_angle = 0.6; // Angle of the camera's defocus blur.
     cam.focus_dist    = 10.0; // Distance from the camera to the focal plane.
 
-    cam.render(world); // Render the scene!
+    // Render every frame on the same threads, started once here and stopped when main returns. They
+    // are spread over the machine's NUMA nodes, and kept on them.
+    auto render_pool = make_shared<thread_pool>(num_threads, opts.pin_threads,
+                                                opts.numa == "off" ? single_numa_node() : detect_numa_nodes());
+    if (render_pool->node_count() > 1) {
+        std::clog << "NUMA: " << render_pool->node_count() << " nodes, render threads per node:";
+        for (int n = 0; n < render_pool->node_count(); n++)
+            std::clog << " " << render_pool->node_size(n);
+        std::clog << "\n";
+    }
+    if (opts.pin_threads || render_pool->node_count() > 1)
+        std::clog << "Pinned " << render_pool->pinned_count() << " of " << num_threads << " render threads\n";
+    cam.pool = render_pool;
+    cam.output_format = opts.format == "p6" ? image_format::p6
+                      : (opts.format == "pfm" ? image_format::pfm
+                      : (opts.format == "png" ? image_format::png
+                      : (opts.format == "exr" ? image_format::exr
+                      : (opts.format == "p3" ? image_format::p3
+                      : image_format_for(opts.output, image_format::p3, image_format::p3)))));
+    cam.tile_size     = opts.tile_size;
+    cam.tile_ordering = opts.tile_order == "rows" ? tile_order::rows
+                      : (opts.tile_order == "spiral" ? tile_order::spiral : tile_order::hilbert);
+    cam.tile_split    = opts.tile_split;
+    cam.seed        = seed;
+    cam.sampling    = opts.sampler == "halton" ? sampler_type::halton
+                    : (opts.sampler == "uniform" ? sampler_type::uniform : sampler_type::sobol);
+
+    // Wrap the scene in a bounding volume hierarchy, so each ray only tests the objects near its path.
+    // The default flat_bvh packs the tree into one array; bvh_node is the pointer-based version.
+    // With --accel linear every ray tests every object, which is useful to measure the speedup.
+    bvh_build_options build_options;
+    build_options.builder = opts.builder == "lbvh" ? bvh_builder::lbvh
+                          : (opts.builder == "sbvh" ? bvh_builder::sbvh : bvh_builder::sah);
+    build_options.num_threads = num_threads;
+    build_options.morton_bits = opts.morton_bits;
+
+    // The wide trees are collapsed from the binary one. They test 4 or 8 child boxes at once,
+    // using the widest SIMD kernel this CPU supports.
+    auto wrap_tree = [&](const shared_ptr<flat_bvh>& tree) -> shared_ptr<hittable> {
+        if (opts.accel == "bvh4")
+            return make_shared<wide_bvh<4>>(*tree);
+        if (opts.accel == "bvh8")
+            return make_shared<wide_bvh<8>>(*tree);
+        return tree;
+    };
+
+    // With --bvh-cache, flat_bvh trees are loaded from the cache directory when the scene matches.
+    auto build_flat_bvh = [&](const hittable_list& objects) {
+        if (opts.bvh_cache.empty())
+            return make_shared<flat_bvh>(objects, build_options);
+        bool cache_hit;
+        auto cached = cached_flat_bvh(objects, build_options, opts.bvh_cache, cache_hit);
+        std::clog << "BVH cache " << (cache_hit ? "hit" : "miss") << " for " << objects.objects.size() << " objects\n";
+        return cached;
+    };
+
+    // The scene's objects, in the order the stock scene adds them. With instances, the grid's
+    // bottom-level structure (`blas`) matches --accel, except that bvh4/bvh8 scenes keep a binary
+    // flat_bvh at the bottom so it can be refit between frames.
+    shared_ptr<flat_bvh> blas_tree;
+    auto make_scene = [&](const shared_ptr<hittable>& blas) {
+        hittable_list objects(ground);
+        if (placements.empty()) {
+            for (const auto& object : tile.objects)
+                objects.add(object);
+        } else {
+            for (const auto& placement : placements)
+                objects.add(make_shared<instance>(blas, placement));
+        }
+        objects.add(glass_sphere);
+        objects.add(metal_sphere);
+        return objects;
+    };
+    auto make_blas = [&]() -> shared_ptr<hittable> {
+        if (opts.accel == "linear")
+            return make_shared<hittable_list>(tile);
+        if (opts.accel == "bvh")
+            return make_shared<bvh_node>(tile);
+        blas_tree = build_flat_bvh(tile);
+        return blas_tree;
+    };
+
+    // --bench runs a benchmark on the scene instead of rendering it.
+    if (opts.bench == "traversal") {
+        bench_traversal(make_scene(placements.empty() ? nullptr : make_blas()), cam, build_options);
+        return 0;
+    }
+
+    shared_ptr<flat_bvh> tree;         // Kept to refit between animation frames.
+
+    std::chrono::high_resolution_clock::time_point buildStart = std::chrono::high_resolution_clock::now();
+    hittable_list scene = make_scene(placements.empty() ? nullptr : make_blas()); // The bare top level, for rebuilds.
+    hittable_list world = scene;
+    if (!placements.empty())
+        std::clog << "Instances: " << placements.size() << " copies of " << tile.objects.size()
+                  << " spheres (" << placements.size() * tile.objects.size() << " instanced spheres)\n";
+
+    if (opts.accel == "bvh") {
+        world = hittable_list(make_shared<bvh_node>(scene)); // bvh_node is always built on one thread with the SAH.
+    } else if (opts.accel != "linear") {
+        tree = build_flat_bvh(scene);
+        std::clog << "BVH SAH cost: " << tree->sah_cost() << " (" << opts.builder << " builder)\n";
+        world = hittable_list(wrap_tree(tree));
+        if (opts.accel == "bvh4")
+            std::clog << "BVH4 box test: " << static_cast<const wide_bvh<4>&>(*world.objects[0]).kernel_name() << "\n";
+        else if (opts.accel == "bvh8")
+            std::clog << "BVH8 box test: " << static_cast<const wide_bvh<8>&>(*world.objects[0]).kernel_name() << "\n";
+    }
+    if (opts.accel != "linear") {
+        // Report the startup cost next to the rendering time printed by the camera.
+        std::chrono::milliseconds buildTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - buildStart);
+        std::clog << "BVH build time: " << buildTime.count() << " milliseconds (" << num_threads << " threads)\n";
+    }
+
+    // With several NUMA nodes, one thread on each makes the node its own copy of the top-level tree, so
+    // the nodes' traversal reads local memory. The primitives themselves, and instanced bottom-level
+    // trees, stay shared.
+    auto replicate_world = [&]() {
+        cam.node_worlds.clear();
+        if (render_pool->node_count() < 2 || !tree)
+            return;
+        cam.node_worlds.resize(render_pool->node_count());
+        render_pool->run([&](int t) {
+            if (render_pool->rank_in_node(t) == 0)
+                cam.node_worlds[render_pool->node_of(t)] = make_shared<hittable_list>(wrap_tree(make_shared<flat_bvh>(*tree)));
+        });
+    };
+    replicate_world();
+
+    if (opts.bench == "tiles") {
+        bench_tiles(world, cam);
+        return 0;
+    }
+
+    // Render the scene! With --frames N, the small spheres then drift and hop between frames, and
+    // each frame is appended to the output as another image.
+    for (int frame = 0; frame < opts.frames; frame++) {
+        if (frame > 0) {
+            for (size_t i = 0; i < small_spheres.size(); i++) {
+                auto heading = 2.39996 * i; // Golden-angle headings spread the spheres out evenly.
+                auto hop = 0.5 * std::fabs(std::sin(0.5 * frame + i));
+                small_spheres[i]->move_to(start_centers[i] + point3(0.1 * frame * std::cos(heading), hop,
+                                                                    0.1 * frame * std::sin(heading)));
+            }
+            tile.update_bounds(); // Lists cache their box, so linear grids and instances of them see the moves.
+
+            // The topology of the tree is still valid, so refit its bounds, unless that has degraded
+            // it past --rebuild-threshold times its SAH cost right after the last build or rebuild.
+            std::chrono::high_resolution_clock::time_point updateStart = std::chrono::high_resolution_clock::now();
+            bool rebuilt = false;
+            if (blas_tree)
+                blas_tree->refit(num_threads); // Instances read their bounds from the shared grid.
+            if (!placements.empty() && !blas_tree)
+                scene = make_scene(make_blas());
+            scene.update_bounds();
+            if (tree) {
+                rebuilt = tree->refit_or_rebuild(opts.rebuild_threshold);
+                world = hittable_list(wrap_tree(tree));
+            } else if (opts.accel == "bvh") {
+                world = hittable_list(make_shared<bvh_node>(scene));
+                rebuilt = true;
+            } else {
+                world = scene;
+            }
+            std::chrono::milliseconds updateTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::high_resolution_clock::now() - updateStart);
+            std::clog << "Frame " << frame << ": BVH " << (rebuilt ? "rebuilt" : "refit") << " in "
+                      << updateTime.count() << " milliseconds";
+            if (tree)
+                std::clog << ", SAH cost growth " << tree->cost_growth();
+            std::clog << "\n";
+        }
+        if (frame > 0)
+            replicate_world();
+        if (!opts.output.empty())
+            cam.output_path = opts.frames > 1 ? frame_path(opts.output, frame) : opts.output;
+        cam.frame = frame; // Each frame gets its own noise.
+        cam.render(world);
+    }
 }
 
@@ -3,14 +3,17 @@
 
 #include "rtweekend.h"
 #include "hittable_list.h"
+#include "sampler.h"
 
 
 class material {
   public:
     virtual ~material() = default;
 
+    // Random choices come from `s`, which is at this bounce's dimensions (see sampler). A material
+    // may read up to sampler::roulette_dimension values from it.
     virtual bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s
     ) const = 0;
 };
 
@@ -19,12 +22,11 @@ class lambertian : public material {
   public:
     lambertian(const color& a) : albedo(a) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s)
     const override {
-        auto scatter_direction = rec.normal + random_unit_vector();
-
-        if (scatter_direction.near_zero())
-            scatter_direction = rec.normal;
+        // Cosine-weighted around the normal, like normal + random unit vector, but from a single warp
+        // that never lands on a degenerate zero direction.
+        auto scatter_direction = sample_cosine_direction(rec.normal, s.get_2d());
 
         scattered = ray(rec.p, scatter_direction);
         attenuation = albedo;
@@ -40,10 +42,11 @@ class metal : public material {
   public:
     metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s)
     const override {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere());
+        auto direction = s.get_2d();
+        scattered = ray(rec.p, reflected + fuzz*sample_in_unit_sphere(direction, s.get_1d()));
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);
     }
@@ -58,7 +61,7 @@ class dielectric : public material {
   public:
     dielectric(double index_of_refraction) : ir(index_of_refraction) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s)
     const override {
         attenuation = color(1.0, 1.0, 1.0);
         double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
@@ -70,7 +73,7 @@ class dielectric : public material {
         bool cannot_refract = refraction_ratio * sin_theta > 1.0;
         vec3 direction;
 
-        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > s.get_1d())
             direction = reflect(unit_direction, rec.normal);
         else
             direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -0,0 +1,77 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include "parallel.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// NUMA topology: which logical CPUs share a memory controller. On multi-socket machines memory is
+// attached to one node, and threads on the other nodes reach it more slowly. Linux places a page on
+// the node of the thread that first touches it, so data is local to whichever threads allocate and
+// fill it, and threads stay local to it only while they are kept on their node's CPUs.
+
+struct numa_node {
+    int id;                // The kernel's node number.
+    std::vector<int> cpus; // Its logical CPUs.
+};
+
+// Parses a Linux CPU or node list such as "0-3,8-11". Returns nothing for malformed lists.
+inline std::vector<int> parse_cpu_list(const std::string& text) {
+    std::vector<int> values;
+    const char* p = text.c_str();
+    while (*p != '\0' && *p != '\n') {
+        char* end;
+        auto first = std::strtol(p, &end, 10);
+        if (end == p)
+            return std::vector<int>();
+        auto last = first;
+        p = end;
+        if (*p == '-') {
+            last = std::strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first)
+                return std::vector<int>();
+            p = end;
+        }
+        for (auto v = first; v <= last; v++)
+            values.push_back(static_cast<int>(v));
+        if (*p == ',')
+            p++;
+    }
+    return values;
+}
+
+// One node holding every CPU, for machines without NUMA or when it is ignored.
+inline std::vector<numa_node> single_numa_node() {
+    numa_node node = {0, std::vector<int>()};
+    for (int cpu = 0; cpu < hardware_thread_count(); cpu++)
+        node.cpus.push_back(cpu);
+    return std::vector<numa_node>(1, node);
+}
+
+// The nodes that have CPUs, read from /sys/devices/system/node. Anywhere that is missing (other
+// systems, kernels without NUMA support) the machine is a single node.
+inline std::vector<numa_node> detect_numa_nodes() {
+    std::vector<numa_node> nodes;
+#if defined(__linux__)
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string ids;
+    if (online && std::getline(online, ids)) {
+        for (auto id : parse_cpu_list(ids)) {
+            std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+            std::string cpus;
+            numa_node node = {id, std::vector<int>()};
+            if (cpulist && std::getline(cpulist, cpus))
+                node.cpus = parse_cpu_list(cpus);
+            if (!node.cpus.empty()) // Memory-only nodes have no threads to run.
+                nodes.push_back(node);
+        }
+    }
+#endif
+    return nodes.empty() ? single_numa_node() : nodes;
+}
+
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+// Command-line settings for main(). The defaults reproduce the stock scene and camera.
+struct render_options {
+    std::string accel     = "flat"; // "linear" tests every object per ray, "bvh" builds a bvh_node, "flat" a flat_bvh,
+                                    // "bvh4"/"bvh8" a wide_bvh with 4 or 8 children per node.
+    std::string builder   = "sah";  // "sah" for good trees, "lbvh" for much faster Morton-code builds,
+                                    // "sbvh" for SAH with spatial splits.
+    int morton_bits       = 30;     // LBVH code length: 30 or 63.
+    std::string simd      = "auto"; // "scalar" disables the vectorized kernels, for comparison.
+    int spheres           = 6400;  // Approximate number of small spheres in the grid (6400 = the stock 80x80 grid).
+    int instances         = 0;     // Copies of the grid sharing one bottom-level BVH. 0 adds the grid directly.
+    int image_width       = 1600;
+    int samples_per_pixel = 500;
+    int max_depth         = 50;
+    int roulette_depth    = 3;     // Bounces before Russian roulette may end a path. 0 disables it.
+    double adaptive       = 0;     // Relative error target for adaptive sampling; --spp becomes the average. 0 disables it.
+    int max_spp           = 0;     // Most samples adaptive sampling gives one pixel. 0 means 8 x --spp.
+    int progressive       = 0;     // Samples per pixel per progressive pass. 0 renders in one pass.
+    double time_limit     = 0;     // Seconds after which rendering stops, keeping the samples so far. 0 never stops.
+    std::string snapshot;          // File to write the image so far to while rendering. Empty writes none.
+    double snapshot_interval = 10; // Seconds between snapshots.
+    std::string sampler   = "sobol"; // Sample values for each path: "sobol", "halton" or "uniform" random numbers.
+    std::string bvh_cache;         // Directory to cache built BVHs in. Empty disables the cache.
+    int seed              = 0;     // Random seed for the scene and the render. 0 seeds from the clock.
+    std::string bench;             // Benchmark to run instead of rendering: "traversal", "rng", "warps", "tiles" or "encode". Empty renders.
+    int threads           = 0;     // Threads for BVH construction and rendering. 0 means one per hardware thread.
+    bool pin_threads      = false; // Pin each render thread to its own CPU.
+    std::string numa      = "auto"; // "auto" spreads render threads, image and scene over the NUMA nodes; "off" ignores them.
+    int tile_size         = 8;     // Edge of the square image tiles handed to render threads, in pixels.
+    std::string tile_order = "hilbert"; // "rows", "hilbert" or "spiral" (from the center out).
+    double tile_split     = 4;     // Split tiles that run this many times slower per pixel than the median. 0 never splits.
+    int frames            = 1;     // Number of animation frames to render.
+    std::string output;            // File to write the image to. Empty writes to standard output.
+    std::string format    = "auto"; // "p3", "p6", "pfm", "png" or "exr". "auto" goes by the file's extension, else P3.
+    double rebuild_threshold = 1.5; // Rebuild the BVH instead of refitting once its SAH cost grows by this factor.
+};
+
+inline void print_usage(const char* program) {
+    std::clog << "Usage: " << program << " [options] > image.ppm, or " << program << " [options] --output FILE\n"
+              << "  --accel linear|bvh|flat|bvh4|bvh8  Ray/scene intersection strategy (default: flat)\n"
+              << "  --builder sah|lbvh|sbvh  BVH construction algorithm (default: sah)\n"
+              << "  --morton-bits 30|63  Morton code length for the lbvh builder (default: 30)\n"
+              << "  --simd auto|scalar   Use the widest SIMD kernels the CPU supports, or none (default: auto)\n"
+              << "  --spheres N          Approximate number of small spheres in the grid (default: 6400)\n"
+              << "  --instances N        Place N transformed copies of the grid, sharing its BVH (default: off)\n"
+              << "  --bvh-cache DIR      Store built BVHs in DIR and reuse them while the scene is unchanged\n"
+              << "  --seed N             Fixed random seed, for the same scene and image on every run (default: from the clock)\n"
+              << "  --bench traversal    Compare traversal steps per ray of SAH and SBVH trees, instead of rendering\n"
+              << "  --bench rng          Compare rand() and per-thread generators from 1 to --threads threads\n"
+              << "  --bench warps        Compare rejection sampling loops with closed-form warps\n"
+              << "  --bench encode       Compare P3 pixel encoders, and serial and parallel PNG/EXR, on a --width image\n"
+              << "  --bench tiles        Compare tile sizes, orders and splitting by how long the last thread runs on\n"
+              << "  --width N            Image width in pixels, below 65536 (default: 1600)\n"
+              << "  --spp N              Samples per pixel (default: 500)\n"
+              << "  --depth N            Maximum ray bounces (default: 50)\n"
+              << "  --adaptive X         Sample until each pixel's relative error is below X, within --spp per pixel on average\n"
+              << "  --max-spp N          Most samples --adaptive gives one pixel (default: 8 x --spp)\n"
+              << "  --progressive K      Add K samples to every pixel per pass, up to --spp (--max-spp with --adaptive)\n"
+              << "  --time-limit S       Stop rendering after S seconds, and output the samples so far\n"
+              << "  --snapshot FILE      Write the image so far to FILE between passes\n"
+              << "  --snapshot-interval S  Seconds between snapshots (default: 10)\n"
+              << "  --roulette N         Let Russian roulette end paths after N bounces, 0 never (default: 3)\n"
+              << "  --sampler sobol|halton|uniform  Sample sequence for pixel, lens and bounce decisions (default: sobol)\n"
+              << "  --threads N          Threads for BVH construction and rendering (default: one per hardware thread)\n"
+              << "  --pin-threads on|off Pin each render thread to its own CPU (default: off)\n"
+              << "  --numa auto|off      Keep render threads, image bands and scene copies on each NUMA node (default: auto)\n"
+              << "  --tile-size N        Edge of the image tiles handed to render threads, in pixels (default: 8)\n"
+              << "  --tile-order rows|hilbert|spiral  Order tiles are dealt out in (default: hilbert)\n"
+              << "  --tile-split X       Split tiles running X times slower per pixel than the median, 0 never (default: 4)\n"
+              << "  --output FILE        Write the image to FILE instead of standard output; with --frames, FILE-0001.ext and so on\n"
+              << "  --format p3|p6|pfm|png|exr  Text PPM, binary PPM, linear float PFM, PNG or half-float OpenEXR\n"
+              << "                       (default: by the extension of --output, else p3)\n"
+              << "  --frames N           Render N frames, moving the small spheres between them (default: 1)\n"
+              << "  --rebuild-threshold X  Rebuild rather than refit the BVH once its SAH cost grows by X (default: 1.5)\n";
+}
+
+// Parses a strictly positive integer, rejecting trailing garbage.
+inline bool parse_positive_int(const char* text, int& value) {
+    char* end;
+    auto parsed = std::strtol(text, &end, 10);
+    if (end == text || *end != '\0' || parsed <= 0)
+        return false;
+    value = static_cast<int>(parsed);
+    return true;
+}
+
+// Fills `opts` from argv. Prints usage and returns false on anything it does not understand.
+inline bool parse_options(int argc, char* argv[], render_options& opts) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        bool ok = value != nullptr;
+
+        if (arg == "--accel" && ok) {
+            opts.accel = value;
+            ok = opts.accel == "linear" || opts.accel == "bvh" || opts.accel == "flat"
+              || opts.accel == "bvh4" || opts.accel == "bvh8";
+        } else if (arg == "--sampler" && ok) {
+            opts.sampler = value;
+            ok = opts.sampler == "sobol" || opts.sampler == "halton" || opts.sampler == "uniform";
+        } else if (arg == "--builder" && ok) {
+            opts.builder = value;
+            ok = opts.builder == "sah" || opts.builder == "lbvh" || opts.builder == "sbvh";
+        } else if (arg == "--morton-bits" && ok) {
+            ok = parse_positive_int(value, opts.morton_bits) && (opts.morton_bits == 30 || opts.morton_bits == 63);
+        } else if (arg == "--simd" && ok) {
+            opts.simd = value;
+            ok = opts.simd == "auto" || opts.simd == "scalar";
+        } else if (arg == "--spheres" && ok) {
+            ok = parse_positive_int(value, opts.spheres);
+        } else if (arg == "--instances" && ok) {
+            ok = parse_positive_int(value, opts.instances);
+        } else if (arg == "--bvh-cache" && ok) {
+            opts.bvh_cache = value;
+            ok = !opts.bvh_cache.empty();
+        } else if (arg == "--seed" && ok) {
+            ok = parse_positive_int(value, opts.seed);
+        } else if (arg == "--bench" && ok) {
+            opts.bench = value;
+            ok = opts.bench == "traversal" || opts.bench == "rng" || opts.bench == "warps"
+              || opts.bench == "tiles" || opts.bench == "encode";
+        } else if (arg == "--width" && ok) {
+            ok = parse_positive_int(value, opts.image_width) && opts.image_width < 65536; // See max_image_side.
+        } else if (arg == "--spp" && ok) {
+            ok = parse_positive_int(value, opts.samples_per_pixel);
+        } else if (arg == "--depth" && ok) {
+            ok = parse_positive_int(value, opts.max_depth);
+        } else if (arg == "--adaptive" && ok) {
+            char* end;
+            opts.adaptive = std::strtod(value, &end);
+            ok = end != value && *end == '\0' && opts.adaptive >= 0;
+        } else if (arg == "--max-spp" && ok) {
+            ok = parse_positive_int(value, opts.max_spp);
+        } else if (arg == "--progressive" && ok) {
+            ok = parse_positive_int(value, opts.progressive);
+        } else if (arg == "--time-limit" && ok) {
+            char* end;
+            opts.time_limit = std::strtod(value, &end);
+            ok = end != value && *end == '\0' && opts.time_limit > 0;
+        } else if (arg == "--snapshot" && ok) {
+            opts.snapshot = value;
+            ok = !opts.snapshot.empty();
+        } else if (arg == "--snapshot-interval" && ok) {
+            char* end;
+            opts.snapshot_interval = std::strtod(value, &end);
+            ok = end != value && *end == '\0' && opts.snapshot_interval >= 0;
+        } else if (arg == "--roulette" && ok) {
+            opts.roulette_depth = 0;
+            ok = std::string(value) == "0" || parse_positive_int(value, opts.roulette_depth);
+        } else if (arg == "--threads" && ok) {
+            ok = parse_positive_int(value, opts.threads);
+        } else if (arg == "--pin-threads" && ok) {
+            ok = std::string(value) == "on" || std::string(value) == "off";
+            opts.pin_threads = std::string(value) == "on";
+        } else if (arg == "--numa" && ok) {
+            opts.numa = value;
+            ok = opts.numa == "auto" || opts.numa == "off";
+        } else if (arg == "--tile-size" && ok) {
+            ok = parse_positive_int(value, opts.tile_size) && opts.tile_size < 65536;
+        } else if (arg == "--tile-order" && ok) {
+            opts.tile_order = value;
+            ok = opts.tile_order == "rows" || opts.tile_order == "hilbert" || opts.tile_order == "spiral";
+        } else if (arg == "--tile-split" && ok) {
+            char* end;
+            opts.tile_split = std::strtod(value, &end);
+            ok = end != value && *end == '\0' && opts.tile_split >= 0;
+        } else if (arg == "--output" && ok) {
+            opts.output = value;
+            ok = !opts.output.empty();
+        } else if (arg == "--format" && ok) {
+            opts.format = value;
+            ok = opts.format == "auto" || opts.format == "p3" || opts.format == "p6" || opts.format == "pfm"
+              || opts.format == "png" || opts.format == "exr";
+        } else if (arg == "--frames" && ok) {
+            ok = parse_positive_int(value, opts.frames);
+        } else if (arg == "--rebuild-threshold" && ok) {
+            char* end;
+            opts.rebuild_threshold = std::strtod(value, &end);
+            ok = end != value && *end == '\0' && opts.rebuild_threshold >= 1;
+        } else {
+            ok = false;
+        }
+
+        if (!ok) {
+            std::clog << "Invalid option: " << arg << (value ? std::string(" ") + value : "") << "\n";
+            print_usage(argv[0]);
+            return false;
+        }
+        i++; // Every option takes exactly one value.
+    }
+    return true;
+}
+
+
+#endif
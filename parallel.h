@@ -0,0 +1,32 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// Number of threads to use when none is configured: one per hardware thread.
+inline int hardware_thread_count() {
+    auto n = std::thread::hardware_concurrency();
+    return n > 0 ? static_cast<int>(n) : 1;
+}
+
+// First index of chunk `c` when [0, count) is cut into `chunks` contiguous, near-equal pieces.
+inline size_t chunk_begin(size_t count, int chunks, int c) {
+    return count * static_cast<size_t>(c) / static_cast<size_t>(chunks);
+}
+
+// Calls fn(chunk, begin, end) for each of `chunks` contiguous pieces of [0, count), concurrently.
+// The calling thread runs chunk 0 itself, and returns once every chunk is done.
+template <typename F>
+void parallel_chunks(size_t count, int chunks, F fn) {
+    std::vector<std::thread> workers;
+    for (int c = 1; c < chunks; c++)
+        workers.push_back(std::thread(fn, c, chunk_begin(count, chunks, c), chunk_begin(count, chunks, c + 1)));
+    fn(0, chunk_begin(count, chunks, 0), chunk_begin(count, chunks, 1));
+    for (auto& worker : workers)
+        worker.join();
+}
+
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <atomic>
+#include <cstdint>
+
+// Per-thread pseudo-random numbers.
+// rand() keeps one global state behind a lock, so render threads drawing millions of samples take
+// turns on it. Every thread instead owns an `rng` (xoshiro256++, Blackman and Vigna 2019): 32 bytes of
+// state, a handful of adds, xors and rotates per number, and no sharing. The render loop creates one
+// per worker, reseeds it from rng_key() for every path and bounce, and passes it down to get_ray() and
+// material::scatter(); code that has none at hand (scene setup, benchmarks) uses thread_rng(), the
+// calling thread's own generator.
+
+// SplitMix64 step, used to expand seeds into full generator states. Consecutive inputs give
+// unrelated outputs, so seeds 1, 2, 3... still start well-separated streams.
+inline uint64_t splitmix64(uint64_t& x) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+class rng {
+  public:
+    explicit rng(uint64_t seed = 0) { reseed(seed); }
+
+    void reseed(uint64_t seed) {
+        for (auto& word : s)
+            word = splitmix64(seed);
+    }
+
+    uint64_t next() {
+        const uint64_t result = rotl(s[0] + s[3], 23) + s[0];
+        const uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    // Uniform in [0, 1), from the top 53 bits: every value is a multiple of 2^-53.
+    double next_double() {
+        return static_cast<double>(next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+  private:
+    uint64_t s[4];
+
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+};
+
+// Counter-based keys, for random numbers that do not depend on which thread draws them or in what
+// order. The renderer chains seed, frame, pixel, sample and bounce through rng_key and reseeds its
+// generator with the result at every bounce of every path, so each bounce draws from its own stream, a
+// pure function of where it is in the image and in the path. Each value is mixed into the hash of the
+// ones before it with SplitMix64's finalizer, which scatters nearby inputs (neighbouring pixels,
+// consecutive samples) over all 64 bits.
+inline uint64_t rng_key(uint64_t key, uint64_t value) {
+    uint64_t x = key ^ (value * 0xd1342543de82ef95ull);
+    return splitmix64(x);
+}
+
+// Seed of thread_rng() generators, and how many of them have been handed out. Each thread's generator
+// gets its own stream from the two, the first (usually the main thread's) stream 0.
+inline std::atomic<uint64_t>& thread_rng_seed() {
+    static std::atomic<uint64_t> seed(0);
+    return seed;
+}
+
+inline std::atomic<uint64_t>& thread_rng_streams() {
+    static std::atomic<uint64_t> streams(0);
+    return streams;
+}
+
+inline rng& thread_rng() {
+    static thread_local rng generator(thread_rng_seed().load()
+                                      + 0x632be59bd9b4e019ull * thread_rng_streams().fetch_add(1));
+    return generator;
+}
+
+
+#endif
@@ -2,11 +2,14 @@
 #define RTWEEKEND_H
 
 #include <cmath>
+#include <cstdint>
 #include <ctime>
 #include <cstdlib>
 #include <limits>
 #include <memory>
 
+#include "rng.h"
+
 using std::shared_ptr;
 using std::make_shared;
 using std::sqrt;
@@ -18,16 +21,27 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
-inline void seed_random() {
-    srand(static_cast<unsigned int>(time(NULL)));
+// Seeds the calling thread's generator, and every thread's that has not drawn a number yet.
+inline void seed_random(uint64_t seed) {
+    thread_rng_seed() = seed;
+    thread_rng().reseed(seed);
+}
+
+inline double random_double(rng& gen) {
+    return gen.next_double();
+}
+
+inline double random_double(rng& gen, double min, double max) {
+    return min + (max-min)*random_double(gen);
 }
 
+// The same, from the calling thread's own generator.
 inline double random_double() {
-    return rand() / (RAND_MAX + 1.0);
+    return random_double(thread_rng());
 }
 
 inline double random_double(double min, double max) {
-    return min + (max-min)*random_double();
+    return random_double(thread_rng(), min, max);
 }
 
 // Common Headers
@@ -0,0 +1,258 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rtweekend.h"
+
+#include <cstdint>
+#include <vector>
+
+// Sample values for the random decisions of a path.
+// Every decision reads its own dimension: the pixel jitter is dimensions 0-1 and the lens position 2-3,
+// then each bounce gets a block of bounce_dimensions for its scatter direction and any choice the
+// material makes. Samplers that know which dimension and which sample of the pixel they are producing
+// can spread each dimension's values evenly over the pixel's samples instead of drawing them
+// independently, which leaves visibly less noise at the same samples per pixel.
+
+struct sample_2d {
+    double u, v;
+};
+
+enum class sampler_type {
+    uniform, // Independent uniform random numbers, like before samplers existed.
+    halton,  // Halton sequence, shifted per pixel. Good in the first few dimensions, weaker deep in a path.
+    sobol    // Owen-scrambled Sobol (0,2) pairs: the least noise, best at power-of-two sample counts.
+};
+
+class sampler {
+  public:
+    static const int camera_dimensions = 4; // Pixel jitter and lens position.
+    static const int bounce_dimensions = 4; // Scatter direction, one for a material choice, one for roulette.
+    static const int roulette_dimension = 3; // Within a bounce's block: whether the path survives it.
+
+    virtual ~sampler() = default;
+
+    // Starts sample `index` of the pixel whose random numbers are keyed by `pixel_key` (see rng_key),
+    // at dimension 0.
+    void start_sample(uint64_t pixel_key, uint32_t index) {
+        key = pixel_key;
+        sample_key = rng_key(pixel_key, index);
+        sample_index = index;
+        dimension = 0;
+    }
+
+    // Moves to the dimensions of bounce `bounce`, where bounce 0 scatters off the first surface hit.
+    void start_bounce(int bounce) {
+        dimension = camera_dimensions + bounce * bounce_dimensions;
+    }
+
+    // The next dimension's value, in [0, 1).
+    double get_1d() {
+        return sample_1d(dimension++);
+    }
+
+    // Value of the roulette dimension of bounce `bounce`, in [0, 1), wherever the materials left off.
+    double get_roulette(int bounce) {
+        dimension = camera_dimensions + bounce * bounce_dimensions + roulette_dimension;
+        return get_1d();
+    }
+
+    // The next two dimensions' values, each in [0, 1).
+    sample_2d get_2d() {
+        auto s = sample_pair(dimension);
+        dimension += 2;
+        return s;
+    }
+
+  protected:
+    uint64_t key = 0;        // The pixel's key: scrambles must stay the same across its samples.
+    uint64_t sample_key = 0; // The pixel's key mixed with the sample index.
+    uint32_t sample_index = 0;
+    int dimension = 0;
+
+    virtual double sample_1d(int dim) const = 0;
+    virtual sample_2d sample_pair(int dim) const = 0;
+
+    // Maps 64 random bits to [0, 1) with 53 bits of precision.
+    static double to_unit(uint64_t bits) {
+        return static_cast<double>(bits >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+
+// Every value an independent hash of (pixel, sample, dimension).
+class uniform_sampler : public sampler {
+  protected:
+    double sample_1d(int dim) const override {
+        return to_unit(rng_key(sample_key, static_cast<uint64_t>(dim)));
+    }
+
+    sample_2d sample_pair(int dim) const override {
+        return { sample_1d(dim), sample_1d(dim + 1) };
+    }
+};
+
+
+// Dimension d is the radical inverse of the sample index in the d-th prime base. Every pixel would
+// otherwise see the same points, so each dimension is shifted by a random offset per pixel, modulo 1
+// (a Cranley-Patterson rotation). The large bases of deep dimensions correlate with each other, so
+// those fall back to uniform values.
+class halton_sampler : public sampler {
+  public:
+    static const int max_dimensions = 128;
+
+  protected:
+    double sample_1d(int dim) const override {
+        if (dim >= max_dimensions)
+            return to_unit(rng_key(sample_key, static_cast<uint64_t>(dim)));
+        auto x = radical_inverse(primes()[dim], sample_index) + to_unit(rng_key(key, static_cast<uint64_t>(dim)));
+        return x >= 1 ? x - 1 : x;
+    }
+
+    sample_2d sample_pair(int dim) const override {
+        return { sample_1d(dim), sample_1d(dim + 1) };
+    }
+
+  private:
+    static double radical_inverse(uint32_t base, uint32_t index) {
+        const double inv_base = 1.0 / base;
+        double inv_base_n = 1, reversed = 0;
+        while (index > 0) {
+            auto next = index / base;
+            reversed = reversed * base + (index - next * base);
+            inv_base_n *= inv_base;
+            index = next;
+        }
+        return reversed * inv_base_n;
+    }
+
+    // The first max_dimensions primes.
+    static const std::vector<uint32_t>& primes() {
+        static const std::vector<uint32_t> table = [] {
+            std::vector<uint32_t> p;
+            for (uint32_t n = 2; p.size() < static_cast<size_t>(max_dimensions); n++) {
+                bool prime = true;
+                for (auto q : p)
+                    prime = prime && n % q != 0;
+                if (prime)
+                    p.push_back(n);
+            }
+            return p;
+        }();
+        return table;
+    }
+};
+
+
+// Shuffled, Owen-scrambled Sobol points (Burley 2020, "Practical Hash-based Owen Scrambling").
+// The first two Sobol dimensions form a (0,2)-sequence: any power-of-two run of samples is stratified in
+// both dimensions and jointly. Every pair of dimensions reuses those two, decorrelated by its own seed:
+// the sample order is shuffled by a nested uniform scramble of the index, and the values are Owen
+// scrambled, both with hash-based permutations, so no deep Sobol direction numbers are needed.
+class sobol_sampler : public sampler {
+  protected:
+    double sample_1d(int dim) const override {
+        auto seed = dimension_seed(dim);
+        auto index = nested_uniform_scramble(sample_index, seed);
+        return to_unit32(nested_uniform_scramble(reverse_bits(index), hash32(seed, 1)));
+    }
+
+    sample_2d sample_pair(int dim) const override {
+        auto seed = dimension_seed(dim);
+        auto index = nested_uniform_scramble(sample_index, seed);
+        return { to_unit32(nested_uniform_scramble(reverse_bits(index), hash32(seed, 1))),
+                 to_unit32(nested_uniform_scramble(sobol_dimension_1(index), hash32(seed, 2))) };
+    }
+
+  private:
+    uint32_t dimension_seed(int dim) const {
+        return static_cast<uint32_t>(rng_key(key, static_cast<uint64_t>(dim)) >> 32);
+    }
+
+    // Cheap 32-bit mix (Wellons' lowbias32), for deriving further seeds from a dimension's seed.
+    static uint32_t hash32(uint32_t seed, uint32_t value) {
+        uint32_t x = seed ^ (value * 0x9e3779b9u);
+        x ^= x >> 16;
+        x *= 0x7feb352du;
+        x ^= x >> 15;
+        x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+
+    static double to_unit32(uint32_t x) {
+        return x * (1.0 / 4294967296.0);
+    }
+
+    static uint32_t reverse_bits(uint32_t x) {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    // Second Sobol dimension; the first is just the bit-reversed index. The generator matrix is
+    // applied a byte of the index at a time, from a table of its products with every byte value.
+    static uint32_t sobol_dimension_1(uint32_t index) {
+        static const std::vector<uint32_t> table = [] {
+            const uint32_t directions[32] = {
+                0x80000000, 0xc0000000, 0xa0000000, 0xf0000000, 0x88000000, 0xcc000000, 0xaa000000, 0xff000000,
+                0x80800000, 0xc0c00000, 0xa0a00000, 0xf0f00000, 0x88880000, 0xcccc0000, 0xaaaa0000, 0xffff0000,
+                0x80008000, 0xc000c000, 0xa000a000, 0xf000f000, 0x88008800, 0xcc00cc00, 0xaa00aa00, 0xff00ff00,
+                0x80808080, 0xc0c0c0c0, 0xa0a0a0a0, 0xf0f0f0f0, 0x88888888, 0xcccccccc, 0xaaaaaaaa, 0xffffffff
+            };
+            std::vector<uint32_t> t(4 * 256, 0);
+            for (int byte = 0; byte < 4; byte++)
+                for (int value = 0; value < 256; value++)
+                    for (int bit = 0; bit < 8; bit++)
+                        if (value & (1 << bit))
+                            t[byte*256 + value] ^= directions[byte*8 + bit];
+            return t;
+        }();
+        return table[index & 0xff] ^ table[256 + ((index >> 8) & 0xff)]
+             ^ table[512 + ((index >> 16) & 0xff)] ^ table[768 + (index >> 24)];
+    }
+
+    // Hash that only ever flips a bit based on the bits below it, i.e. a random permutation that keeps
+    // the low-bit structure (Laine and Karras 2011, constants from Burley 2020).
+    static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return x;
+    }
+
+    // Owen scrambling: each bit is flipped based on the bits above it, which keeps stratification.
+    static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+        return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+    }
+};
+
+
+inline shared_ptr<sampler> make_sampler(sampler_type type) {
+    switch (type) {
+        case sampler_type::halton: return make_shared<halton_sampler>();
+        case sampler_type::sobol:  return make_shared<sobol_sampler>();
+        default:                   return make_shared<uniform_sampler>();
+    }
+}
+
+
+// The closed-form warps of vec3.h, fed from sample values.
+
+inline vec3 sample_in_unit_sphere(const sample_2d& s, double w) {
+    return std::cbrt(w) * square_to_unit_vector(s.u, s.v);
+}
+
+inline vec3 sample_in_unit_disk(const sample_2d& s) {
+    return square_to_unit_disk(s.u, s.v);
+}
+
+inline vec3 sample_cosine_direction(const vec3& normal, const sample_2d& s) {
+    return local_to_world(square_to_cosine_hemisphere(s.u, s.v), normal);
+}
+
+
+#endif
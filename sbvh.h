@@ -0,0 +1,154 @@
+#ifndef SBVH_H
+#define SBVH_H
+
+#include "rtweekend.h"
+#include "bvh.h"
+#include "hittable.h"
+
+// Spatial-split BVH (SBVH) construction (Stich, Friedrich and Dietrich 2009, "Spatial Splits in Bounding
+// Volume Hierarchies").
+// Object splits send every primitive entirely to one side, so a single large primitive, like the ground
+// sphere, stretches whichever child it lands in over most of the scene. A spatial split cuts space at a
+// plane instead: primitives that straddle it are referenced from both children, each reference clipped
+// to its own side. The builder tries both kinds of split at every node and keeps the cheaper under the
+// SAH, within a budget on how many extra references the tree may hold.
+
+// Spatial splits are only tried where the children of the best object split overlap by more than this
+// fraction of the root's surface area. Elsewhere they rarely win and binning them is expensive.
+const double sbvh_overlap_threshold = 1e-5;
+
+// Extra references the whole tree may hold, as a fraction of the number of primitives.
+const double sbvh_max_duplication = 1.0;
+
+// Writable counterpart of aabb::axis, for cutting boxes.
+inline interval& box_axis(aabb& box, int axis) {
+    return axis == 0 ? box.x : (axis == 1 ? box.y : box.z);
+}
+
+// Binned evaluation of spatial split planes for one node.
+// Bins are equal slices of the node's bounds. A reference enters the bin holding its minimum and exits
+// the bin holding its maximum; its part inside every bin it touches is clipped out and added to that bin.
+// For a plane between bins, the left child then gets every reference that entered left of it, and the
+// right child every one that exited right of it: straddling references are counted on both sides.
+class spatial_binning {
+  public:
+    spatial_binning(const aabb& _node_bounds) : node_bounds(_node_bounds) {
+        for (int a = 0; a < 3; a++) {
+            auto extent = node_bounds.axis(a).size();
+            width[a] = extent > 0 ? extent / bvh_sah_bins : 0; // Flat axes cannot be split.
+            for (int b = 0; b < bvh_sah_bins; b++)
+                entries[a][b] = exits[a][b] = 0;
+        }
+    }
+
+    int bin_index(int axis, double x) const {
+        auto b = static_cast<int>((x - node_bounds.axis(axis).min) / width[axis]);
+        return b < 0 ? 0 : (b >= bvh_sah_bins ? bvh_sah_bins - 1 : b);
+    }
+
+    // Position of the plane below bin b.
+    double plane(int axis, int b) const {
+        return node_bounds.axis(axis).min + b * width[axis];
+    }
+
+    void add(const hittable& object, const aabb& box) {
+        for (int a = 0; a < 3; a++) {
+            if (width[a] == 0)
+                continue;
+            auto first = bin_index(a, box.axis(a).min);
+            auto last = bin_index(a, box.axis(a).max);
+            entries[a][first]++;
+            exits[a][last]++;
+            if (first == last) {
+                bounds[a][first] = aabb(bounds[a][first], box);
+                continue;
+            }
+            for (int b = first; b <= last; b++) {
+                aabb slab(interval::universe, interval::universe, interval::universe);
+                box_axis(slab, a) = interval(b == first ? -infinity : plane(a, b),
+                                         b == last ? infinity : plane(a, b + 1));
+                bounds[a][b] = aabb(bounds[a][b], object.clipped_bounding_box(box.intersect(slab)));
+            }
+        }
+    }
+
+    // Finds the cheapest plane over all axes for a node with `count` references. Returns its SAH cost and
+    // sets `axis` and `split_bin` (the plane below that bin), plus the bounds and reference counts of the
+    // two sides. Returns infinity with axis = -1 if no plane leaves references on both sides.
+    double best_split(size_t count, int& axis, int& split_bin, aabb& left, aabb& right,
+                      size_t& left_count, size_t& right_count) const {
+        auto best_cost = infinity;
+        axis = -1;
+        split_bin = 0;
+
+        auto node_area = node_bounds.surface_area();
+        if (node_area <= 0) node_area = 1;
+
+        for (int a = 0; a < 3; a++) {
+            if (width[a] == 0)
+                continue;
+
+            aabb right_boxes[bvh_sah_bins];
+            size_t right_counts[bvh_sah_bins];
+            aabb right_box;
+            size_t exited = 0;
+            for (int b = bvh_sah_bins - 1; b > 0; b--) {
+                right_box = aabb(right_box, bounds[a][b]);
+                exited += exits[a][b];
+                right_boxes[b] = right_box;
+                right_counts[b] = exited;
+            }
+
+            aabb left_box;
+            size_t entered = 0;
+            for (int b = 1; b < bvh_sah_bins; b++) {
+                left_box = aabb(left_box, bounds[a][b-1]);
+                entered += entries[a][b-1];
+                if (entered == 0 || right_counts[b] == 0 || (entered == count && right_counts[b] == count))
+                    continue;
+
+                auto cost = bvh_traversal_cost + bvh_intersection_cost
+                          * (left_box.surface_area() * entered + right_boxes[b].surface_area() * right_counts[b])
+                          / node_area;
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    axis = a;
+                    split_bin = b;
+                    left = left_box;
+                    right = right_boxes[b];
+                    left_count = entered;
+                    right_count = right_counts[b];
+                }
+            }
+        }
+
+        return best_cost;
+    }
+
+  private:
+    aabb   node_bounds;
+    double width[3];
+    aabb   bounds[3][bvh_sah_bins];
+    size_t entries[3][bvh_sah_bins];
+    size_t exits[3][bvh_sah_bins];
+};
+
+// Clips reference `ref` to the two sides of the plane at `position` on `axis`. A side the object does
+// not reach gets an empty box.
+inline void split_reference(const hittable& object, const bvh_primitive& ref, int axis, double position,
+                            bvh_primitive& left, bvh_primitive& right) {
+    aabb below(interval::universe, interval::universe, interval::universe);
+    aabb above = below;
+    box_axis(below, axis).max = position;
+    box_axis(above, axis).min = position;
+
+    left = ref;
+    right = ref;
+    left.bbox = object.clipped_bounding_box(ref.bbox.intersect(below));
+    right.bbox = object.clipped_bounding_box(ref.bbox.intersect(above));
+    left.centroid = left.bbox.centroid();
+    right.centroid = right.bbox.centroid();
+}
+
+
+#endif
@@ -0,0 +1,381 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "aligned_allocator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Work-stealing distribution of image tiles over render threads.
+// Every thread owns a deque, filled up front with a contiguous run of tiles, so a thread's tiles are
+// neighbours and share cache contents (geometry, BVH nodes). A thread takes work from its own deque
+// without contending with anyone; once it runs dry it steals from the other end of another thread's
+// deque, which keeps every thread busy until the whole image is done. A tile that turns out much slower
+// than usual has its unrendered rest split off and offered to the other threads, so they can help with it.
+
+// Chase-Lev work-stealing deque (Chase and Lev 2005, with the C11 memory orders of Le et al. 2013).
+// The owner pushes and pops at the bottom; any thread, the owner included, may steal from the top.
+// Slots are atomics so that a steal racing with the owner is still well defined, which limits T to
+// types that are lock-free as atomics (integers). The capacity is fixed; push() fails when the deque is full.
+template <typename T>
+class work_stealing_deque {
+  public:
+    enum class steal_result { success, empty, lost_race };
+
+    explicit work_stealing_deque(size_t min_capacity) : top(0), bottom(0) {
+        size_t capacity = 1;
+        while (capacity < min_capacity)
+            capacity *= 2;
+        mask = capacity - 1;
+        items = std::vector<std::atomic<T>>(capacity);
+    }
+
+    // Owner only.
+    bool push(T item) {
+        auto b = bottom.load(std::memory_order_relaxed);
+        auto t = top.load(std::memory_order_acquire);
+        if (b - t > static_cast<int64_t>(mask))
+            return false;
+        items[static_cast<size_t>(b) & mask].store(item, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Owner only: takes the most recently pushed item.
+    bool pop(T& item) {
+        auto b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = top.load(std::memory_order_relaxed);
+
+        if (t > b) { // Already empty.
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        item = items[static_cast<size_t>(b) & mask].load(std::memory_order_relaxed);
+        if (t == b) {
+            // The last item: a thief may be taking it at the same time, and only one of us gets it.
+            bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // Any thread: takes the oldest item. A lost race means another thread took it first; the deque
+    // may still hold more.
+    steal_result steal(T& item) {
+        auto t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto b = bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return steal_result::empty;
+
+        item = items[static_cast<size_t>(t) & mask].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return steal_result::lost_race;
+        return steal_result::success;
+    }
+
+  private:
+    // Top and bottom a cache line apart: thieves write one, the owner the other.
+    std::atomic<int64_t> top;
+    char padding[cache_line_size];
+    std::atomic<int64_t> bottom;
+    size_t mask;
+    std::vector<std::atomic<T>> items;
+};
+
+
+// Largest image width or height tiles can describe: render_tile packs each coordinate into 16 bits.
+const int max_image_side = 65535;
+
+// A rectangle of pixels, [x0, x1) x [y0, y1). Packed into 64 bits for the deques.
+struct render_tile {
+    int x0, y0, x1, y1;
+
+    uint64_t pack() const {
+        return static_cast<uint64_t>(x0) | static_cast<uint64_t>(y0) << 16
+             | static_cast<uint64_t>(x1) << 32 | static_cast<uint64_t>(y1) << 48;
+    }
+
+    static render_tile unpack(uint64_t bits) {
+        return { static_cast<int>(bits & 0xffff), static_cast<int>((bits >> 16) & 0xffff),
+                 static_cast<int>((bits >> 32) & 0xffff), static_cast<int>(bits >> 48) };
+    }
+};
+
+enum class tile_order {
+    rows,    // Row by row, left to right.
+    hilbert, // Along a Hilbert curve: consecutive tiles are always neighbours, so runs of them are compact.
+    spiral   // From the center out, ring by ring: the subject, usually the slowest part, is done first.
+};
+
+// Position of cell (x, y) along the Hilbert curve through an n x n grid, n a power of two.
+inline uint64_t hilbert_index(uint32_t n, uint32_t x, uint32_t y) {
+    uint64_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) ? 1 : 0;
+        uint32_t ry = (y & s) ? 1 : 0;
+        d += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+        // Rotate the quadrant, so the curve inside it starts and ends at the right corners.
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// Covers a width x height image with tiles of tile_size x tile_size pixels (smaller at the right and
+// bottom edges), listed in `order`.
+inline std::vector<render_tile> make_tiles(int width, int height, int tile_size, tile_order order) {
+    auto columns = (width + tile_size - 1) / tile_size;
+    auto rows = (height + tile_size - 1) / tile_size;
+    uint32_t grid = 1;
+    while (grid < static_cast<uint32_t>(std::max(columns, rows)))
+        grid *= 2;
+
+    std::vector<std::pair<double, render_tile>> keyed;
+    for (int ty = 0; ty < rows; ty++) {
+        for (int tx = 0; tx < columns; tx++) {
+            render_tile tile = {tx * tile_size, ty * tile_size,
+                                std::min((tx + 1) * tile_size, width), std::min((ty + 1) * tile_size, height)};
+            double key;
+            if (order == tile_order::hilbert) {
+                key = static_cast<double>(hilbert_index(grid, static_cast<uint32_t>(tx), static_cast<uint32_t>(ty)));
+            } else if (order == tile_order::spiral) {
+                // Rings by distance from the center, in half tiles; within a ring, tiles go around it
+                // by angle, scaled into [0, 1] so that rings never interleave.
+                auto dx = 2 * tx - (columns - 1), dy = 2 * ty - (rows - 1);
+                auto ring = std::max(std::abs(dx), std::abs(dy));
+                key = 2.0 * ring + 0.5 + std::atan2(dy, dx) / (4 * std::acos(0.0));
+            } else {
+                key = static_cast<double>(ty) * columns + tx;
+            }
+            keyed.push_back(std::make_pair(key, tile));
+        }
+    }
+    std::stable_sort(keyed.begin(), keyed.end(),
+                     [](const std::pair<double, render_tile>& a, const std::pair<double, render_tile>& b) {
+                         return a.first < b.first;
+                     });
+
+    std::vector<render_tile> tiles;
+    for (const auto& k : keyed)
+        tiles.push_back(k.second);
+    return tiles;
+}
+
+// What one thread did during a render.
+struct scheduler_thread_stats {
+    uint64_t tiles = 0;         // Tiles rendered, own and stolen.
+    uint64_t steals = 0;        // Tiles taken from other threads.
+    uint64_t failed_steals = 0; // Steal attempts that found nothing or lost a race.
+    uint64_t splits = 0;        // Slow tiles whose rest was split off for other threads.
+    double idle_seconds = 0;    // Time spent looking for work after the own deque ran dry, and then
+                                // waiting for the other threads to finish.
+    std::chrono::steady_clock::time_point finished; // When the thread found no work left.
+
+    // Adds the counts of a later render pass.
+    void add(const scheduler_thread_stats& pass) {
+        tiles += pass.tiles;
+        steals += pass.steals;
+        failed_steals += pass.failed_steals;
+        splits += pass.splits;
+        idle_seconds += pass.idle_seconds;
+        finished = pass.finished;
+    }
+};
+
+class tile_scheduler {
+  public:
+    // Deals `tiles` out to `num_threads` threads in contiguous runs. Tiles should be in an order that
+    // keeps neighbours close, e.g. rows of tiles or a Hilbert curve. Images must be at most
+    // max_image_side pixels per side. A tile whose time per pixel runs past `split_factor` times the median of the
+    // thread's recent tiles is split (see split_if_slow); 0 never splits.
+    tile_scheduler(const std::vector<render_tile>& tiles, int num_threads, double split_factor = 0)
+      : tile_scheduler(std::vector<std::vector<render_tile>>(1, tiles), std::vector<int>(num_threads, 0),
+                       split_factor) {}
+
+    // The same for threads on several NUMA nodes: thread t is on node thread_nodes[t], and node n's
+    // tiles, node_tiles[n], are only dealt to its own threads, so a node with tiles needs a thread.
+    // Thieves look for work on their own node before they go to another.
+    tile_scheduler(const std::vector<std::vector<render_tile>>& node_tiles, const std::vector<int>& thread_nodes,
+                   double split_factor)
+      : thread_stats(thread_nodes.size()), timings(thread_nodes.size()), split_factor(split_factor) {
+        auto num_threads = static_cast<int>(thread_nodes.size());
+        std::vector<std::vector<int>> node_members(node_tiles.size());
+        for (int t = 0; t < num_threads; t++)
+            node_members[thread_nodes[t]].push_back(t);
+
+        deques.resize(thread_nodes.size());
+        split_deques.resize(thread_nodes.size());
+        for (size_t n = 0; n < node_tiles.size(); n++) {
+            const auto& tiles = node_tiles[n];
+            auto members = static_cast<int>(node_members[n].size());
+            for (int m = 0; m < members; m++) {
+                auto t = node_members[n][m];
+                auto first = tiles.size() * m / members;
+                auto last = tiles.size() * (m + 1) / members;
+                deques[t] = std::make_shared<work_stealing_deque<uint64_t>>(last - first);
+                // Room for a split off every tile of the share. When it is full a slow tile simply is not split.
+                split_deques[t] = std::make_shared<work_stealing_deque<uint64_t>>(last - first + 16);
+                // Pushed in reverse, so the owner pops its run front to back and thieves take from its end.
+                for (auto i = last; i-- > first; )
+                    deques[t]->push(tiles[i].pack());
+            }
+        }
+
+        // Victims in order: the following threads of the same node, then those of the other nodes,
+        // each starting after this thread so thieves spread over victims.
+        for (int t = 0; t < num_threads; t++) {
+            std::vector<int> order;
+            for (int pass = 0; pass < 2; pass++)
+                for (int k = 1; k < num_threads; k++) {
+                    auto v = (t + k) % num_threads;
+                    if ((thread_nodes[v] == thread_nodes[t]) == (pass == 0))
+                        order.push_back(v);
+                }
+            victims.push_back(order);
+        }
+    }
+
+    // Gets thread `thread` its next tile: its own if it has any, otherwise one split off a slow tile
+    // (its own included), otherwise one stolen from another thread. Returns false once no thread has
+    // tiles left.
+    bool next(int thread, render_tile& tile) {
+        auto& stats = thread_stats[thread];
+        uint64_t bits;
+        if (deques[thread]->pop(bits)) {
+            tile = render_tile::unpack(bits);
+            stats.tiles++;
+            return true;
+        }
+
+        auto idle_start = std::chrono::steady_clock::now();
+        const auto& others = victims[thread];
+        bool found = false, contended = true, own = false;
+        while (!found && contended) {
+            // Sweep the other threads. Only a sweep that finds every deque empty ends the search; lost
+            // races mean there is work left.
+            contended = false;
+            // Split-off rests first: they are what the slowest tiles are still waiting for. Most of the
+            // time there are none, so finding one empty is not counted as a failed steal.
+            for (size_t k = 0; k <= others.size() && !found; k++) {
+                auto result = split_deques[k == 0 ? thread : others[k - 1]]->steal(bits);
+                if (result == work_stealing_deque<uint64_t>::steal_result::success) {
+                    found = true;
+                    own = k == 0;
+                } else if (result == work_stealing_deque<uint64_t>::steal_result::lost_race) {
+                    stats.failed_steals++;
+                    contended = true;
+                }
+            }
+            for (size_t k = 0; k < others.size() && !found; k++) {
+                auto result = deques[others[k]]->steal(bits);
+                if (result == work_stealing_deque<uint64_t>::steal_result::success) {
+                    found = true;
+                } else {
+                    stats.failed_steals++;
+                    contended = contended || result == work_stealing_deque<uint64_t>::steal_result::lost_race;
+                }
+            }
+        }
+        stats.idle_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - idle_start).count();
+
+        if (!found) {
+            stats.finished = std::chrono::steady_clock::now();
+            return false;
+        }
+        tile = render_tile::unpack(bits);
+        stats.tiles++;
+        if (!own)
+            stats.steals++;
+        return true;
+    }
+
+    // Called by `thread` after each row of `tile`, with the rows rendered so far and the seconds they took.
+    // If the tile is running slow, the lower half of its unrendered rows becomes a tile of its own and
+    // `tile` shrinks to the rest. The new tile goes to the thread's split deque, which the thread itself
+    // never pops: idle threads take it, and look there before they steal ordinary tiles. The thread
+    // only comes back for it once its own deque has run dry.
+    bool split_if_slow(int thread, render_tile& tile, int rows_done, double seconds) {
+        const auto& timing = timings[thread];
+        auto rows_left = tile.y1 - tile.y0 - rows_done;
+        if (split_factor <= 0 || timing.median_pixel_seconds <= 0 || rows_left < 2)
+            return false;
+        if (seconds / (static_cast<double>(rows_done) * (tile.x1 - tile.x0)) < split_factor * timing.median_pixel_seconds)
+            return false;
+
+        render_tile rest = {tile.x0, tile.y0 + rows_done + (rows_left + 1) / 2, tile.x1, tile.y1};
+        if (!split_deques[thread]->push(rest.pack()))
+            return false;
+        tile.y1 = rest.y0;
+        thread_stats[thread].splits++;
+        return true;
+    }
+
+    // Called by `thread` once it has rendered all of `tile` (as shrunk by split_if_slow) in `seconds`.
+    void tile_done(int thread, const render_tile& tile, double seconds) {
+        auto& timing = timings[thread];
+        auto pixel_seconds = seconds / ((tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+        if (timing.recent.size() < timing_window) {
+            timing.recent.push_back(pixel_seconds);
+        } else {
+            timing.recent[timing.next] = pixel_seconds;
+            timing.next = (timing.next + 1) % timing_window;
+        }
+        if (timing.recent.size() >= min_timed_tiles) {
+            timing.sorted = timing.recent;
+            auto middle = timing.sorted.begin() + timing.sorted.size() / 2;
+            std::nth_element(timing.sorted.begin(), middle, timing.sorted.end());
+            timing.median_pixel_seconds = *middle;
+        }
+    }
+
+    // Ends `thread`'s part of the render early. Tiles still in its deque stay unrendered unless stolen.
+    void stop(int thread) {
+        thread_stats[thread].finished = std::chrono::steady_clock::now();
+    }
+
+    // Call once every thread is done: counts the time each spent waiting for the last one as idle.
+    void finish() {
+        auto now = std::chrono::steady_clock::now();
+        for (auto& stats : thread_stats)
+            stats.idle_seconds += std::chrono::duration<double>(now - stats.finished).count();
+    }
+
+    const std::vector<scheduler_thread_stats>& stats() const { return thread_stats; }
+
+  private:
+    std::vector<std::shared_ptr<work_stealing_deque<uint64_t>>> deques; // Deques hold atomics and cannot move.
+    std::vector<std::shared_ptr<work_stealing_deque<uint64_t>>> split_deques; // Split-off rests; only stolen from.
+    std::vector<scheduler_thread_stats> thread_stats;   // Each entry only written by its own thread.
+    std::vector<std::vector<int>> victims;              // The deques each thread steals from, in order.
+
+    // Seconds per pixel of a thread's most recent tiles, for telling slow tiles from usual ones.
+    static const size_t timing_window = 64;
+    static const size_t min_timed_tiles = 8; // No splits before this many tiles are timed.
+    struct thread_timing {
+        std::vector<double> recent, sorted;
+        size_t next = 0;
+        double median_pixel_seconds = 0;
+    };
+    std::vector<thread_timing> timings; // Each entry only used by its own thread.
+    double split_factor;
+};
+
+
+#endif
@@ -8,7 +8,11 @@
 class sphere : public hittable {
   public:
     sphere(point3 _center, double _radius, shared_ptr<material> _material)
-      : center(_center), radius(_radius), mat(_material) {}
+      : center(_center), radius(_radius), mat(_material)
+    {
+        auto rvec = vec3(radius, radius, radius);
+        bbox = aabb(center - rvec, center + rvec);
+    }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         vec3 oc = r.origin() - center;
@@ -38,10 +42,43 @@ class sphere : public hittable {
         return true;
     }
 
+    aabb bounding_box() const override { return bbox; }
+
+    // Each pair of opposite box faces cuts the sphere into a slab. The slab's widest cross-section is
+    // the circle nearest the center, which bounds it on the other two axes.
+    aabb clipped_bounding_box(const aabb& box) const override {
+        aabb clipped = bbox.intersect(box);
+        for (int a = 0; a < 3 && !clipped.is_empty(); a++) {
+            interval slab = clipped.axis(a);
+            auto d = center[a] < slab.min ? slab.min - center[a] : (center[a] > slab.max ? center[a] - slab.max : 0);
+            if (d > radius)
+                return aabb(); // The sphere does not reach into the box.
+            // (radius - d)(radius + d) rather than radius^2 - d^2, which cancels badly near the sphere's edge.
+            auto r = sqrt((radius - d) * (radius + d)) * (1 + 1e-9) + 1e-12 * radius;
+
+            point3 lo = center - vec3(r, r, r), hi = center + vec3(r, r, r);
+            lo[a] = slab.min;
+            hi[a] = slab.max;
+            clipped = clipped.intersect(aabb(lo, hi));
+        }
+        return clipped;
+    }
+
+    // Moves the sphere, e.g. between animation frames. Acceleration structures holding it must be
+    // refit (or rebuilt) afterwards, and it must not be called while rendering.
+    void move_to(const point3& new_center) {
+        center = new_center;
+        auto rvec = vec3(radius, radius, radius);
+        bbox = aabb(center - rvec, center + rvec);
+    }
+
   private:
+    friend class sphere_soa; // Copies the fields into its arrays.
+
     point3 center;
     double radius;
     shared_ptr<material> mat;
+    aabb bbox;
 };
 
 
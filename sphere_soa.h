@@ -0,0 +1,257 @@
+#ifndef SPHERE_SOA_H
+#define SPHERE_SOA_H
+
+#include "rtweekend.h"
+#include "aligned_allocator.h"
+#include "cpu_features.h"
+#include "hittable.h"
+#include "sphere.h"
+
+#include <vector>
+
+// Sphere data laid out as structure-of-arrays: one array per coordinate of the centers and one for the
+// radii, so consecutive spheres fill consecutive SIMD lanes. Materials are only needed for the sphere
+// that was hit, so they live apart from the data the intersection loop streams through.
+struct sphere_lanes {
+    const double* x;
+    const double* y;
+    const double* z;
+    const double* radius;
+};
+
+// Signature shared by the batch kernels: intersects the ray with spheres [first, first + count), and on
+// a hit inside ray_t returns true with the nearest distance in `t` and that sphere's index in `index`.
+typedef bool (*sphere_batch_kernel)(const sphere_lanes& s, const ray& r, size_t first, size_t count,
+                                    interval ray_t, double& t, size_t& index);
+
+// Finishes the test of sphere i once its discriminant is known to be non-negative: the nearest root
+// inside ray_t, as in sphere::hit. Narrows ray_t on a hit.
+inline bool sphere_nearest_root(double half_b, double a, double discriminant, size_t i,
+                                interval& ray_t, double& t, size_t& index) {
+    auto sqrtd = sqrt(discriminant);
+    auto root = (-half_b - sqrtd) / a;
+    if (!ray_t.surrounds(root)) {
+        root = (-half_b + sqrtd) / a;
+        if (!ray_t.surrounds(root))
+            return false;
+    }
+    ray_t.max = root;
+    t = root;
+    index = i;
+    return true;
+}
+
+// Same arithmetic as sphere::hit, in the same order, so every kernel finds exactly the same hits.
+inline bool sphere_batch_scalar(const sphere_lanes& s, const ray& r, size_t first, size_t count,
+                                interval ray_t, double& t, size_t& index) {
+    const point3 origin = r.origin();
+    const vec3 direction = r.direction();
+    auto a = direction.length_squared();
+    bool hit = false;
+
+    for (size_t i = first; i < first + count; i++) {
+        vec3 oc = origin - point3(s.x[i], s.y[i], s.z[i]);
+        auto half_b = dot(oc, direction);
+        auto c = oc.length_squared() - s.radius[i]*s.radius[i];
+        auto discriminant = half_b*half_b - a*c;
+        if (discriminant >= 0)
+            hit |= sphere_nearest_root(half_b, a, discriminant, i, ray_t, t, index);
+    }
+    return hit;
+}
+
+#ifdef RT_X86_64
+// The SIMD kernels compute the discriminants of a whole batch at once. Most spheres in a leaf are
+// missed, so only the few lanes with a real intersection go on to the square root and the divisions,
+// one at a time and in lane order, which keeps the nearest hit and its tie-breaking the same as the
+// scalar loop's.
+
+// 4 spheres per instruction. Lanes past the end of the range are masked off on load and never hit.
+RT_TARGET_AVX2
+inline bool sphere_batch_avx2(const sphere_lanes& s, const ray& r, size_t first, size_t count,
+                              interval ray_t, double& t, size_t& index) {
+    const point3 origin = r.origin();
+    const vec3 direction = r.direction();
+    const __m256d ox = _mm256_set1_pd(origin[0]), oy = _mm256_set1_pd(origin[1]), oz = _mm256_set1_pd(origin[2]);
+    const __m256d dx = _mm256_set1_pd(direction[0]), dy = _mm256_set1_pd(direction[1]), dz = _mm256_set1_pd(direction[2]);
+    const double a = direction.length_squared();
+    const __m256d va = _mm256_set1_pd(a);
+    const __m256i lanes = _mm256_setr_epi64x(0, 1, 2, 3);
+    bool hit = false;
+
+    for (size_t i = first; i < first + count; i += 4) {
+        auto remaining = static_cast<long long>(first + count - i);
+        const __m256i active = _mm256_cmpgt_epi64(_mm256_set1_epi64x(remaining), lanes);
+
+        __m256d ocx = _mm256_sub_pd(ox, _mm256_maskload_pd(s.x + i, active));
+        __m256d ocy = _mm256_sub_pd(oy, _mm256_maskload_pd(s.y + i, active));
+        __m256d ocz = _mm256_sub_pd(oz, _mm256_maskload_pd(s.z + i, active));
+        __m256d radius = _mm256_maskload_pd(s.radius + i, active);
+
+        __m256d half_b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)), _mm256_mul_pd(ocz, dz));
+        __m256d oc_len = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz));
+        __m256d c = _mm256_sub_pd(oc_len, _mm256_mul_pd(radius, radius));
+        __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(va, c));
+
+        int candidates = _mm256_movemask_pd(_mm256_and_pd(
+            _mm256_cmp_pd(discriminant, _mm256_setzero_pd(), _CMP_GE_OQ), _mm256_castsi256_pd(active)));
+        if (candidates == 0)
+            continue;
+
+        alignas(32) double half_bs[4], discriminants[4];
+        _mm256_store_pd(half_bs, half_b);
+        _mm256_store_pd(discriminants, discriminant);
+        for (int k = 0; k < 4; k++)
+            if (candidates & (1 << k))
+                hit |= sphere_nearest_root(half_bs[k], a, discriminants[k], i + k, ray_t, t, index);
+    }
+    return hit;
+}
+
+// 8 spheres per instruction.
+RT_TARGET_AVX512
+inline bool sphere_batch_avx512(const sphere_lanes& s, const ray& r, size_t first, size_t count,
+                                interval ray_t, double& t, size_t& index) {
+    const point3 origin = r.origin();
+    const vec3 direction = r.direction();
+    const __m512d ox = _mm512_set1_pd(origin[0]), oy = _mm512_set1_pd(origin[1]), oz = _mm512_set1_pd(origin[2]);
+    const __m512d dx = _mm512_set1_pd(direction[0]), dy = _mm512_set1_pd(direction[1]), dz = _mm512_set1_pd(direction[2]);
+    const double a = direction.length_squared();
+    const __m512d va = _mm512_set1_pd(a);
+    bool hit = false;
+
+    for (size_t i = first; i < first + count; i += 8) {
+        auto remaining = first + count - i;
+        const __mmask8 active = static_cast<__mmask8>(remaining >= 8 ? 0xff : (1u << remaining) - 1);
+
+        __m512d ocx = _mm512_sub_pd(ox, _mm512_maskz_loadu_pd(active, s.x + i));
+        __m512d ocy = _mm512_sub_pd(oy, _mm512_maskz_loadu_pd(active, s.y + i));
+        __m512d ocz = _mm512_sub_pd(oz, _mm512_maskz_loadu_pd(active, s.z + i));
+        __m512d radius = _mm512_maskz_loadu_pd(active, s.radius + i);
+
+        __m512d half_b = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, dx), _mm512_mul_pd(ocy, dy)), _mm512_mul_pd(ocz, dz));
+        __m512d oc_len = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, ocx), _mm512_mul_pd(ocy, ocy)), _mm512_mul_pd(ocz, ocz));
+        __m512d c = _mm512_sub_pd(oc_len, _mm512_mul_pd(radius, radius));
+        __m512d discriminant = _mm512_sub_pd(_mm512_mul_pd(half_b, half_b), _mm512_mul_pd(va, c));
+
+        unsigned candidates = _mm512_mask_cmp_pd_mask(active, discriminant, _mm512_setzero_pd(), _CMP_GE_OQ);
+        if (candidates == 0)
+            continue;
+
+        alignas(64) double half_bs[8], discriminants[8];
+        _mm512_store_pd(half_bs, half_b);
+        _mm512_store_pd(discriminants, discriminant);
+        for (int k = 0; k < 8; k++)
+            if (candidates & (1u << k))
+                hit |= sphere_nearest_root(half_bs[k], a, discriminants[k], i + k, ray_t, t, index);
+    }
+    return hit;
+}
+#endif
+
+
+// A set of spheres intersected in SIMD batches, with the widest kernel the CPU supports (AVX-512: 8
+// spheres per instruction, AVX2: 4, otherwise the scalar loop). As a hittable it tests every sphere it
+// holds; BVHs over spheres use hit_range() to test just the spheres of one leaf (see flat_bvh).
+class sphere_soa : public hittable {
+  public:
+    sphere_soa() { select_kernel(); }
+
+    void clear() {
+        center_x.clear(); center_y.clear(); center_z.clear(); radius.clear();
+        materials.clear();
+        bbox = aabb();
+    }
+
+    void add(const sphere& s) {
+        center_x.push_back(s.center[0]);
+        center_y.push_back(s.center[1]);
+        center_z.push_back(s.center[2]);
+        radius.push_back(s.radius);
+        materials.push_back(s.mat);
+        bbox = aabb(bbox, s.bounding_box());
+    }
+
+    // Copies sphere i's current center and radius, e.g. after it moved. Touches nothing shared, so
+    // threads may update different spheres at once; call update_bounds() once they are done.
+    void update(size_t i, const sphere& s) {
+        center_x[i] = s.center[0];
+        center_y[i] = s.center[1];
+        center_z[i] = s.center[2];
+        radius[i] = s.radius;
+    }
+
+    // Recomputes the bounding box from the spheres as they are now.
+    void update_bounds() {
+        bbox = aabb();
+        for (size_t i = 0; i < size(); i++) {
+            auto r = vec3(radius[i], radius[i], radius[i]);
+            auto center = point3(center_x[i], center_y[i], center_z[i]);
+            bbox = aabb(bbox, aabb(center - r, center + r));
+        }
+    }
+
+    size_t size() const { return radius.size(); }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return hit_range(r, ray_t, rec, 0, size());
+    }
+
+    // Intersects the ray with spheres [first, first + count) only. The hit record is filled in like
+    // sphere::hit does, once, for the nearest sphere.
+    bool hit_range(const ray& r, interval ray_t, hit_record& rec, size_t first, size_t count) const {
+        sphere_lanes lanes = { center_x.data(), center_y.data(), center_z.data(), radius.data() };
+        double t;
+        size_t i;
+        if (!kernel(lanes, r, first, count, ray_t, t, i))
+            return false;
+
+        rec.t = t;
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - point3(center_x[i], center_y[i], center_z[i])) / radius[i];
+        rec.set_face_normal(r, outward_normal);
+        rec.mat = materials[i];
+        return true;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    const char* kernel_name() const { return kernel_label; }
+
+    // Spheres the selected kernel tests per instruction. BVH builders size leaves to multiples of it.
+    static size_t batch_width() {
+#ifdef RT_X86_64
+        if (active_simd_level() >= simd_level::avx512)
+            return 8;
+        if (active_simd_level() >= simd_level::avx2)
+            return 4;
+#endif
+        return 1;
+    }
+
+  private:
+    typedef std::vector<double, aligned_allocator<double, cache_line_size>> lane_array;
+
+    lane_array center_x, center_y, center_z, radius;
+    std::vector<shared_ptr<material>> materials;
+    aabb bbox;
+    sphere_batch_kernel kernel;
+    const char* kernel_label;
+
+    void select_kernel() {
+        kernel = &sphere_batch_scalar;
+        kernel_label = "scalar";
+#ifdef RT_X86_64
+        if (active_simd_level() >= simd_level::avx512) {
+            kernel = &sphere_batch_avx512;
+            kernel_label = "avx512";
+        } else if (active_simd_level() >= simd_level::avx2) {
+            kernel = &sphere_batch_avx2;
+            kernel_label = "avx2";
+        }
+#endif
+    }
+};
+
+
+#endif
@@ -0,0 +1,54 @@
+// Rebuilding an SBVH tree must start again from the source primitives: not from the leaf-order list,
+// which holds the references duplicated by spatial splits, and which leaf_order() does not index.
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "flat_bvh.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <iostream>
+
+static int failures = 0;
+
+static void check(bool condition, const char* what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << "\n";
+        failures++;
+    }
+}
+
+int main() {
+    // A grid of small spheres with a few large ones through it, which the SBVH builder splits spatially.
+    hittable_list list;
+    auto gray = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    for (int i = 0; i < 20; i++)
+        for (int j = 0; j < 20; j++)
+            list.add(make_shared<sphere>(point3(i, 0, j), 0.2, gray));
+    for (int k = 0; k < 4; k++)
+        list.add(make_shared<sphere>(point3(5 + 3 * k, 0, 10), 10, gray));
+
+    bvh_build_options options;
+    options.builder = bvh_builder::sbvh;
+    flat_bvh tree(list, options);
+    const auto references = tree.leaf_order().size();
+    check(references > list.objects.size(), "the scene makes spatial splits");
+
+    for (int round = 0; round < 3; round++) {
+        tree.rebuild();
+        check(tree.leaf_order().size() == references, "a rebuild keeps the number of leaf references");
+        check(tree.leaf_objects().size() == references, "a rebuild keeps the number of leaf objects");
+        bool in_range = true;
+        for (size_t i = 0; i < tree.leaf_order().size(); i++) {
+            auto index = tree.leaf_order()[i];
+            in_range = in_range && index < list.objects.size() && tree.leaf_objects()[i] == list.objects[index];
+        }
+        check(in_range, "leaf_order() still indexes the source list");
+    }
+
+    if (failures == 0)
+        std::cout << "flat_bvh rebuild: all checks passed\n";
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+// Refitting on several threads must leave a sphere-leaf tree exactly as a serial refit would: every
+// sphere moved in the leaf arrays, and their bounds recomputed once the subtree tasks are done.
+
+#include "rtweekend.h"
+
+#include "color.h"
+#include "flat_bvh.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <iostream>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool condition, const char* what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << "\n";
+        failures++;
+    }
+}
+
+static bool contains(const aabb& outer, const aabb& inner) {
+    for (int a = 0; a < 3; a++)
+        if (inner.axis(a).min < outer.axis(a).min || inner.axis(a).max > outer.axis(a).max)
+            return false;
+    return true;
+}
+
+static bool same(const aabb& a, const aabb& b) {
+    for (int n = 0; n < 3; n++)
+        if (a.axis(n).min != b.axis(n).min || a.axis(n).max != b.axis(n).max)
+            return false;
+    return true;
+}
+
+int main() {
+    rng gen(17);
+    hittable_list list;
+    std::vector<shared_ptr<sphere>> spheres;
+    auto gray = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    for (int i = 0; i < 4000; i++) {
+        auto center = point3(random_double(gen, -50, 50), random_double(gen, -50, 50), random_double(gen, -50, 50));
+        spheres.push_back(make_shared<sphere>(center, random_double(gen, 0.1, 0.5), gray));
+        list.add(spheres.back());
+    }
+
+    bvh_build_options options;
+    options.num_threads = 8;
+    flat_bvh tree(list, options);
+    check(tree.sphere_leaf_storage() != nullptr, "an all-sphere scene has sphere leaves");
+
+    for (int frame = 0; frame < 4; frame++) {
+        // Pull everything toward the middle, so the bounds must shrink as well as move.
+        std::vector<point3> centers;
+        aabb expected;
+        for (auto& s : spheres) {
+            auto box = s->bounding_box();
+            auto center = 0.5 * (point3(box.x.min, box.y.min, box.z.min) + point3(box.x.max, box.y.max, box.z.max));
+            center = 0.7 * center + vec3(random_double(gen, -1, 1), random_double(gen, -1, 1), random_double(gen, -1, 1));
+            s->move_to(center);
+            expected = aabb(expected, s->bounding_box());
+        }
+        tree.refit(8);
+
+        check(same(tree.sphere_leaf_storage()->bounding_box(), expected), "the leaf spheres' bounds are recomputed");
+        bool enclosed = true;
+        for (auto& s : spheres)
+            enclosed = enclosed && contains(tree.bounding_box(), s->bounding_box());
+        check(enclosed, "the root bounds enclose every moved sphere");
+
+        int mismatches = 0;
+        for (int i = 0; i < 2000; i++) {
+            auto origin = point3(random_double(gen, -60, 60), random_double(gen, -60, 60), -100);
+            auto target = point3(random_double(gen, -40, 40), random_double(gen, -40, 40), 0);
+            ray r(origin, target - origin);
+            hit_record from_tree, from_list;
+            bool tree_hit = tree.hit(r, interval(0.001, infinity), from_tree);
+            bool list_hit = list.hit(r, interval(0.001, infinity), from_list);
+            if (tree_hit != list_hit || (tree_hit && std::fabs(from_tree.t - from_list.t) > 1e-9 * from_list.t))
+                mismatches++;
+        }
+        check(mismatches == 0, "the refit tree hits what the plain list hits");
+    }
+
+    if (failures == 0)
+        std::cout << "flat_bvh refit: all checks passed\n";
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "numa.h"
+#include "parallel.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+    #include <windows.h>
+#elif defined(__linux__)
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+
+// Restricts `thread` to the logical CPUs in `cpus`. Returns false where that is unsupported or refused.
+inline bool pin_thread(std::thread& thread, const std::vector<int>& cpus) {
+#if defined(_WIN32)
+    DWORD_PTR mask = 0;
+    for (auto cpu : cpus)
+        if (cpu < 64)
+            mask |= DWORD_PTR(1) << cpu;
+    return mask != 0 && SetThreadAffinityMask(thread.native_handle(), mask) != 0;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus)
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    return CPU_COUNT(&set) > 0 && pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+    (void)thread;
+    (void)cpus;
+    return false;
+#endif
+}
+
+// Long-lived worker threads, created once and reused for every render instead of being started and
+// joined on each call. run() hands the same job to every worker and returns once all of them have
+// finished it; between jobs the workers sleep on a condition variable.
+// Workers are spread over the NUMA nodes in contiguous blocks, in proportion to each node's CPUs. On a
+// machine with several nodes every worker is kept on its node's CPUs, so the memory it first touches
+// stays local to it. With `pin_threads` each worker is further pinned to a single CPU of its node, so
+// its caches stay warm too.
+class thread_pool {
+  public:
+    explicit thread_pool(int num_threads = 0, bool pin_threads = false)
+      : thread_pool(num_threads, pin_threads, single_numa_node()) {}
+
+    thread_pool(int num_threads, bool pin_threads, const std::vector<numa_node>& nodes) : nodes(nodes) {
+        auto count = num_threads > 0 ? num_threads : hardware_thread_count();
+        size_t total_cpus = 0;
+        for (const auto& node : nodes)
+            total_cpus += node.cpus.size();
+
+        size_t cpus_before = 0;
+        for (int n = 0; n < node_count(); n++) {
+            const auto& cpus = nodes[n].cpus;
+            auto first = static_cast<int>(count * cpus_before / total_cpus);
+            cpus_before += cpus.size();
+            auto last = static_cast<int>(count * cpus_before / total_cpus);
+            node_threads.push_back(last - first);
+            for (int i = first; i < last; i++) {
+                thread_nodes.push_back(n);
+                thread_ranks.push_back(i - first);
+                workers.push_back(std::thread([this, i] { work(i); }));
+                bool ok = true;
+                if (pin_threads)
+                    ok = pin_thread(workers.back(), std::vector<int>(1, cpus[(i - first) % cpus.size()]));
+                else if (node_count() > 1)
+                    ok = pin_thread(workers.back(), cpus);
+                if (ok && (pin_threads || node_count() > 1))
+                    pinned++;
+            }
+        }
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    ~thread_pool() { shutdown(); }
+
+    int size() const { return static_cast<int>(workers.size()); }
+
+    // Calls job(i) on every worker i at once, and waits until all calls have returned. Must not be
+    // called from inside a job, or after shutdown().
+    void run(const std::function<void(int)>& job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        current_job = &job;
+        remaining = size();
+        generation++;
+        wake.notify_all();
+        done.wait(lock, [this] { return remaining == 0; });
+        current_job = nullptr;
+    }
+
+    // Stops the workers once they are idle and joins them. Safe to call more than once.
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers)
+            if (worker.joinable())
+                worker.join();
+    }
+
+    // Number of workers that were pinned to their CPU or node.
+    int pinned_count() const { return pinned; }
+
+    int node_count() const { return static_cast<int>(nodes.size()); }
+    const numa_node& node(int n) const { return nodes[n]; }
+    int node_size(int n) const { return node_threads[n]; } // Workers on node n; may be 0.
+
+    int node_of(int thread) const { return thread_nodes[thread]; }
+    int rank_in_node(int thread) const { return thread_ranks[thread]; } // 0 for the node's first worker.
+    const std::vector<int>& thread_node_list() const { return thread_nodes; }
+
+  private:
+    std::vector<std::thread> workers;
+    std::vector<numa_node> nodes;
+    std::vector<int> node_threads, thread_nodes, thread_ranks;
+    std::mutex mutex;
+    std::condition_variable wake; // Signals a new job, or shutdown.
+    std::condition_variable done; // Signals that the last worker finished the job.
+    const std::function<void(int)>* current_job = nullptr;
+    uint64_t generation = 0; // Counts jobs, so workers can tell a new one from the one they just ran.
+    int remaining = 0;
+    bool stopping = false;
+    int pinned = 0;
+
+    void work(int index) {
+        uint64_t seen = 0;
+        while (true) {
+            const std::function<void(int)>* job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+                job = current_job;
+            }
+            (*job)(index);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--remaining == 0)
+                    done.notify_one();
+            }
+        }
+    }
+};
+
+
+#endif
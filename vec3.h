@@ -81,7 +81,15 @@ class vec3 {
 
     // Usage: Generate a random vector with x, y, z components between min and max.
     static vec3 random(double min, double max) {
-        return vec3(random_double(min,max), random_double(min,max), random_double(min,max));
+        return random(thread_rng(), min, max);
+    }
+
+    // Usage: The same, drawing from the caller's generator (e.g. a render thread's own).
+    static vec3 random(rng& gen, double min, double max) {
+        auto x = random_double(gen, min, max);
+        auto y = random_double(gen, min, max);
+        auto z = random_double(gen, min, max);
+        return vec3(x, y, z);
     }
 };
 
@@ -153,34 +161,97 @@ inline vec3 unit_vector(vec3 v) {
 
 // Chapter 9 [Diffuse Materials Below!]
 
-inline vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1,1), random_double(-1,1), 0);
-        if (p.length_squared() < 1)
-            return p;
-    }
+// Closed-form warps from the unit square [0,1)^2 onto shapes. Each takes exactly two uniform values and
+// no loop, so a sample always costs the same number of random numbers, and low-discrepancy points (see
+// sampler.h) keep their even spread after the mapping.
+
+// Uniform on the unit sphere, in spherical coordinates: z uniform in [-1, 1], then an angle around z.
+inline vec3 square_to_unit_vector(double u, double v) {
+    auto z = 1 - 2*u;
+    auto r = sqrt(fmax(0.0, 1 - z*z));
+    auto phi = 2*pi*v;
+    return vec3(r*cos(phi), r*sin(phi), z);
 }
 
-inline vec3 random_in_unit_sphere() {
-    while (true) {
-        auto p = vec3::random(-1,1);
-        if (p.length_squared() < 1)
-            return p;
+// Uniform in the unit disk (z = 0), with Shirley and Chiu's concentric mapping: squares around the
+// center go to circles, so nearby points stay nearby and areas keep their proportions.
+inline vec3 square_to_unit_disk(double u, double v) {
+    auto a = 2*u - 1;
+    auto b = 2*v - 1;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+    double r, phi;
+    if (a*a > b*b) {
+        r = a;
+        phi = (pi/4) * (b/a);
+    } else {
+        r = b;
+        phi = (pi/2) - (pi/4) * (a/b);
     }
+    return vec3(r*cos(phi), r*sin(phi), 0);
+}
+
+// Cosine-weighted on the hemisphere around +z (Malley's method): a uniform disk point lifted onto it.
+inline vec3 square_to_cosine_hemisphere(double u, double v) {
+    auto p = square_to_unit_disk(u, v);
+    return vec3(p.x(), p.y(), sqrt(fmax(0.0, 1 - p.x()*p.x() - p.y()*p.y())));
+}
+
+// Rotates `local`, given with +z as the up axis, into the frame around unit vector `n`, from an
+// orthonormal basis built without branches or normalization (Duff et al. 2017).
+inline vec3 local_to_world(const vec3& local, const vec3& n) {
+    auto sign = std::copysign(1.0, n.z());
+    auto a = -1 / (sign + n.z());
+    auto b = n.x() * n.y() * a;
+    vec3 t(1 + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+    vec3 bt(b, sign + n.y() * n.y() * a, -n.y());
+    return local.x()*t + local.y()*bt + local.z()*n;
 }
 
-inline vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+// The samplers below take the generator to draw from. Render threads pass their own; the versions
+// without one use the calling thread's (see rng.h).
+
+inline vec3 random_in_unit_disk(rng& gen) {
+    auto u = random_double(gen);
+    auto v = random_double(gen);
+    return square_to_unit_disk(u, v);
+}
+
+// Uniform in the unit ball: a direction, scaled by the cube root of a third value, since the volume
+// within radius r grows as r^3.
+inline vec3 random_in_unit_sphere(rng& gen) {
+    auto u = random_double(gen);
+    auto v = random_double(gen);
+    return std::cbrt(random_double(gen)) * square_to_unit_vector(u, v);
+}
+
+inline vec3 random_unit_vector(rng& gen) {
+    auto u = random_double(gen);
+    auto v = random_double(gen);
+    return square_to_unit_vector(u, v);
 }
 
-inline vec3 random_on_hemisphere(const vec3& normal) {
-    vec3 on_unit_sphere = random_unit_vector();
+inline vec3 random_on_hemisphere(const vec3& normal, rng& gen) {
+    vec3 on_unit_sphere = random_unit_vector(gen);
     if (dot(on_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
         return on_unit_sphere;
     else
         return -on_unit_sphere;
 }
 
+// Cosine-weighted around unit vector `normal`: the distribution of Lambertian scattering.
+inline vec3 random_cosine_direction(const vec3& normal, rng& gen) {
+    auto u = random_double(gen);
+    auto v = random_double(gen);
+    return local_to_world(square_to_cosine_hemisphere(u, v), normal);
+}
+
+inline vec3 random_in_unit_disk() { return random_in_unit_disk(thread_rng()); }
+inline vec3 random_in_unit_sphere() { return random_in_unit_sphere(thread_rng()); }
+inline vec3 random_unit_vector() { return random_unit_vector(thread_rng()); }
+inline vec3 random_on_hemisphere(const vec3& normal) { return random_on_hemisphere(normal, thread_rng()); }
+inline vec3 random_cosine_direction(const vec3& normal) { return random_cosine_direction(normal, thread_rng()); }
+
 inline vec3 reflect(const vec3& v, const vec3& n) {
     return v - 2*dot(v,n)*n;
 }
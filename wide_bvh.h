@@ -0,0 +1,306 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "rtweekend.h"
+#include "aligned_allocator.h"
+#include "cpu_features.h"
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <cstdint>
+#include <vector>
+
+// One node of a wide_bvh with up to N children.
+// Child boxes are stored as structure-of-arrays, one SIMD lane per child, so a single slab test
+// checks every child at once. Unused slots hold an inverted (empty) box that no ray can hit.
+template <int N>
+struct alignas(64) wide_bvh_node {
+    float    bounds[6][N]; // Rows: min x, min y, min z, max x, max y, max z.
+    uint32_t child[N];     // Interior child: node index. Leaf child: index of its first primitive.
+    uint16_t count[N];     // Leaf child: number of primitives. 0 for interior children and unused slots.
+};
+
+// Per-ray constants for the wide slab test. near_row/far_row pick the bounds row a ray enters/leaves
+// through on each axis, which avoids per-lane swaps and keeps empty slots from ever being hit.
+struct wide_ray {
+    float origin[3];
+    float inv_dir[3];
+    int   near_row[3];
+    int   far_row[3];
+    float t_min;
+};
+
+// Signature shared by the box-test kernels: tests N child boxes, writes each entry distance to t_near,
+// and returns a bit mask of the children the ray hits before t_max.
+typedef unsigned (*wide_box_kernel)(const float* bounds, const wide_ray& r, float t_max, float* t_near);
+
+// Exit distances are padded by a few ulps so float rounding never loses a hit (see flat_bvh::node_hit).
+const float wide_bvh_exit_padding = 1.0000004f;
+
+template <int N>
+unsigned wide_boxes_scalar(const float* bounds, const wide_ray& r, float t_max, float* t_near) {
+    unsigned mask = 0;
+    for (int k = 0; k < N; k++) {
+        auto t0 = r.t_min, t1 = t_max;
+        for (int a = 0; a < 3; a++) {
+            auto enter = (bounds[r.near_row[a]*N + k] - r.origin[a]) * r.inv_dir[a];
+            auto leave = (bounds[r.far_row[a]*N + k] - r.origin[a]) * r.inv_dir[a] * wide_bvh_exit_padding;
+            t0 = enter > t0 ? enter : t0;
+            t1 = leave < t1 ? leave : t1;
+        }
+        t_near[k] = t0;
+        if (t0 <= t1)
+            mask |= 1u << k;
+    }
+    return mask;
+}
+
+#ifdef RT_X86_64
+// 4 children per test. SSE is part of x86-64, so this needs no target attribute.
+// The operand order of max/min matters: they return the second operand for NaN lanes (0 * inf),
+// which keeps the running interval unchanged rather than poisoning it.
+inline unsigned wide_boxes4_sse(const float* bounds, const wide_ray& r, float t_max, float* t_near) {
+    __m128 t0 = _mm_set1_ps(r.t_min);
+    __m128 t1 = _mm_set1_ps(t_max);
+    const __m128 padding = _mm_set1_ps(wide_bvh_exit_padding);
+    for (int a = 0; a < 3; a++) {
+        const __m128 origin = _mm_set1_ps(r.origin[a]);
+        const __m128 inv_dir = _mm_set1_ps(r.inv_dir[a]);
+        __m128 enter = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds + 4*r.near_row[a]), origin), inv_dir);
+        __m128 leave = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds + 4*r.far_row[a]), origin), inv_dir);
+        t0 = _mm_max_ps(enter, t0);
+        t1 = _mm_min_ps(_mm_mul_ps(leave, padding), t1);
+    }
+    _mm_storeu_ps(t_near, t0);
+    return static_cast<unsigned>(_mm_movemask_ps(_mm_cmple_ps(t0, t1)));
+}
+
+// 8 children per test, on AVX2 machines (including AVX-512 ones).
+RT_TARGET_AVX2
+inline unsigned wide_boxes8_avx2(const float* bounds, const wide_ray& r, float t_max, float* t_near) {
+    __m256 t0 = _mm256_set1_ps(r.t_min);
+    __m256 t1 = _mm256_set1_ps(t_max);
+    const __m256 padding = _mm256_set1_ps(wide_bvh_exit_padding);
+    for (int a = 0; a < 3; a++) {
+        const __m256 origin = _mm256_set1_ps(r.origin[a]);
+        const __m256 inv_dir = _mm256_set1_ps(r.inv_dir[a]);
+        __m256 enter = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds + 8*r.near_row[a]), origin), inv_dir);
+        __m256 leave = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds + 8*r.far_row[a]), origin), inv_dir);
+        t0 = _mm256_max_ps(enter, t0);
+        t1 = _mm256_min_ps(_mm256_mul_ps(leave, padding), t1);
+    }
+    _mm256_storeu_ps(t_near, t0);
+    return static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)));
+}
+#endif
+
+
+// Bounding volume hierarchy with N = 4 or 8 children per node.
+// Built by collapsing a binary flat_bvh: each wide node repeatedly replaces its largest interior child by
+// that child's own children until it has N of them. Traversal tests all children of a node with one SIMD
+// slab test and visits the hit ones nearest-first. The kernel is picked at construction from the CPU's
+// features, with a portable scalar fallback.
+template <int N>
+class wide_bvh : public hittable {
+    static_assert(N == 4 || N == 8, "wide_bvh supports 4 or 8 children per node");
+
+  public:
+    wide_bvh(const hittable_list& list, const bvh_build_options& options = bvh_build_options())
+      : wide_bvh(flat_bvh(list, options)) {}
+
+    wide_bvh(const flat_bvh& binary) : bbox(binary.bounding_box()), objects(binary.leaf_objects()) {
+        for (const auto& object : objects)
+            primitives.push_back(object.get());
+        if (binary.sphere_leaf_storage()) {
+            leaf_spheres = *binary.sphere_leaf_storage();
+            sphere_leaves = true;
+        }
+        if (binary.node_count() > 0)
+            collapse(binary, 0);
+        select_kernel();
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty())
+            return false;
+
+        wide_ray wr;
+        for (int a = 0; a < 3; a++) {
+            wr.origin[a] = static_cast<float>(r.origin()[a]);
+            wr.inv_dir[a] = 1.0f / static_cast<float>(r.direction()[a]);
+            bool negative = std::signbit(wr.inv_dir[a]);
+            wr.near_row[a] = negative ? 3 + a : a;
+            wr.far_row[a] = negative ? a : 3 + a;
+        }
+        wr.t_min = static_cast<float>(ray_t.min);
+
+        bool hit_anything = false;
+        auto closest_so_far = ray_t.max;
+
+        // Stack entries are either a node (count == 0) or a leaf's primitive range, with the distance
+        // at which the ray enters it so entries beyond the closest hit can be dropped when popped.
+        stack_entry stack[flat_bvh_max_depth * (N - 1) + 1];
+        int stack_size = 0;
+        stack[stack_size++] = stack_entry(0, 0, -std::numeric_limits<float>::infinity());
+
+        while (stack_size > 0) {
+            const stack_entry entry = stack[--stack_size];
+            if (entry.t_near > closest_so_far)
+                continue;
+
+            if (entry.count > 0) {
+                if (sphere_leaves) {
+                    if (leaf_spheres.hit_range(r, interval(ray_t.min, closest_so_far), rec, entry.index, entry.count)) {
+                        hit_anything = true;
+                        closest_so_far = rec.t;
+                    }
+                    continue;
+                }
+                for (uint32_t i = entry.index; i < entry.index + entry.count; i++) {
+                    if (primitives[i]->hit(r, interval(ray_t.min, closest_so_far), rec)) {
+                        hit_anything = true;
+                        closest_so_far = rec.t;
+                    }
+                }
+                continue;
+            }
+
+            const wide_bvh_node<N>& node = nodes[entry.index];
+            float t_near[N];
+            unsigned mask = kernel(&node.bounds[0][0], wr, static_cast<float>(closest_so_far), t_near);
+
+            // Insertion-sort the hit children by distance, farthest first, then push them in that
+            // order so the nearest child is popped next.
+            stack_entry hits[N];
+            int hit_count = 0;
+            for (int k = 0; k < N; k++) {
+                if (!(mask & (1u << k)))
+                    continue;
+                stack_entry child(node.child[k], node.count[k], t_near[k]);
+                int i = hit_count++;
+                while (i > 0 && hits[i-1].t_near < child.t_near) {
+                    hits[i] = hits[i-1];
+                    i--;
+                }
+                hits[i] = child;
+            }
+            for (int i = 0; i < hit_count; i++)
+                stack[stack_size++] = hits[i];
+        }
+
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t node_count() const { return nodes.size(); }
+
+    const char* kernel_name() const { return kernel_label; }
+
+  private:
+    struct stack_entry {
+        uint32_t index;
+        uint32_t count;
+        float    t_near;
+
+        stack_entry() {}
+        stack_entry(uint32_t i, uint32_t c, float t) : index(i), count(c), t_near(t) {}
+    };
+
+    std::vector<wide_bvh_node<N>, aligned_allocator<wide_bvh_node<N>, cache_line_size>> nodes;
+    aabb bbox;
+    std::vector<shared_ptr<hittable>> objects; // Same leaf order as the binary tree, so leaf offsets carry over.
+    std::vector<const hittable*> primitives;
+    sphere_soa leaf_spheres; // Copied from the binary tree when all primitives are spheres.
+    bool sphere_leaves = false;
+    wide_box_kernel kernel;
+    const char* kernel_label;
+
+    void select_kernel() {
+        kernel = &wide_boxes_scalar<N>;
+        kernel_label = "scalar";
+#ifdef RT_X86_64
+        if (N == 4 && active_simd_level() >= simd_level::sse) {
+            kernel = &wide_boxes4_sse;
+            kernel_label = "sse";
+        }
+        if (N == 8 && active_simd_level() >= simd_level::avx2) {
+            kernel = &wide_boxes8_avx2;
+            kernel_label = "avx2";
+        }
+#endif
+    }
+
+    static float area(const flat_bvh_node& node) {
+        auto dx = node.bounds_max[0] - node.bounds_min[0];
+        auto dy = node.bounds_max[1] - node.bounds_min[1];
+        auto dz = node.bounds_max[2] - node.bounds_min[2];
+        return dx*dy + dy*dz + dz*dx;
+    }
+
+    // Emits the wide node standing in for binary node `binary_index`, then its descendants.
+    uint32_t collapse(const flat_bvh& binary, uint32_t binary_index) {
+        auto index = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(wide_bvh_node<N>());
+
+        uint32_t slots[N];
+        int used = 0;
+        const flat_bvh_node& top = binary.node(binary_index);
+        if (top.is_leaf()) {
+            slots[used++] = binary_index; // Only happens at the root of a tiny scene.
+        } else {
+            slots[used++] = binary_index + 1;
+            slots[used++] = top.offset;
+        }
+
+        // Open the interior child with the largest area until the node is full. Large boxes are the
+        // likeliest to be hit, so pulling their children up saves the most node visits.
+        while (used < N) {
+            int best = -1;
+            float best_area = -1;
+            for (int k = 0; k < used; k++) {
+                const flat_bvh_node& child = binary.node(slots[k]);
+                if (!child.is_leaf() && area(child) > best_area) {
+                    best = k;
+                    best_area = area(child);
+                }
+            }
+            if (best < 0)
+                break;
+
+            auto opened = slots[best];
+            slots[best] = opened + 1;
+            slots[used++] = binary.node(opened).offset;
+        }
+
+        for (int k = 0; k < N; k++) {
+            for (int a = 0; a < 3; a++) {
+                nodes[index].bounds[a][k] = std::numeric_limits<float>::infinity();
+                nodes[index].bounds[3+a][k] = -std::numeric_limits<float>::infinity();
+            }
+            nodes[index].child[k] = 0;
+            nodes[index].count[k] = 0;
+        }
+
+        for (int k = 0; k < used; k++) {
+            const flat_bvh_node& child = binary.node(slots[k]);
+            for (int a = 0; a < 3; a++) {
+                nodes[index].bounds[a][k] = child.bounds_min[a];
+                nodes[index].bounds[3+a][k] = child.bounds_max[a];
+            }
+            if (child.is_leaf()) {
+                nodes[index].child[k] = child.offset;
+                nodes[index].count[k] = child.count;
+            } else {
+                auto child_index = collapse(binary, slots[k]); // May reallocate `nodes`.
+                nodes[index].child[k] = child_index;
+            }
+        }
+
+        return index;
+    }
+};
+
+
+#endif